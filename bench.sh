@@ -0,0 +1,135 @@
+#!/bin/bash
+# $Id$
+#
+# bench.sh - Throughput benchmark of dskread and dskwrite without hardware.
+#
+# Generates the synthetic images of dskgen, reads each from the simulated
+# drive and writes it to a blank simulated disk in every mode, and prints
+# one tab separated line per run:
+#
+#   image tool mode tracks ioctls commands revolutions revs/track wall cpu
+#
+# The simulated figures do not depend on the host, so any change in them is
+# a change in the read or write path. wall and cpu are the host seconds of
+# the fastest of $BENCH_RUNS runs (default 3), cpu is user plus system.
+#
+# usage: bench.sh [-c <baseline>] [<trace>[:<options>] ...]
+#
+#   -c <baseline>  compare with the output of an earlier run and fail if
+#                  ioctls or revolutions grew by more than $BENCH_TOLERANCE
+#                  percent (default 1), or cpu by more than $BENCH_CPU
+#                  percent (default 50, only above 10 ms)
+#   <trace>        also read traces recorded with dskread --record, with
+#                  the dskread options given after the colon
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+RUNS=${BENCH_RUNS:-3}
+TOLERANCE=${BENCH_TOLERANCE:-1}
+CPU=${BENCH_CPU:-50}
+
+READ_MODES=("" "-c" "-c -i" "-c -P" "-R" "-c -w 3")
+WRITE_MODES=("" "-c" "-c -v")
+
+# dskgen kind and the dskread options it needs
+IMAGES=(data system data80 ds mixed prot)
+declare -A READ_OPTS=([data80]="-t 80" [ds]="-t 80 -S 2")
+
+baseline=
+if [ "$1" = "-c" ]; then
+	baseline=$2
+	shift 2
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# run <image> <tool> <mode> <command...>: time the command and print its line
+run() {
+	local image=$1 tool=$2 mode=$3 i best= cpu= t
+	shift 3
+	for ((i=0; i<RUNS; i++)); do
+		rm -f "$tmp/out.dsk" "$tmp/blank.dsk"
+		t=$( { TIMEFORMAT='%R %U %S'; time "$@" >"$tmp/log" 2>&1; } 2>&1 )
+		read -r real user sys <<<"$t"
+		if [ -z "$best" ] || awk "BEGIN { exit !($real < $best) }"; then
+			best=$real
+			cpu=$(awk "BEGIN { printf \"%.3f\", $user + $sys }")
+		fi
+	done
+	awk -v image="$image" -v tool="$tool" -v mode="${mode:--}" \
+		-v wall="$best" -v cpu="$cpu" '
+		/^Latency ms/ { table = 0 }
+		table { ioctls += $2; cmds += $3 }
+		/^FDC ioctls/ { table = 1 }
+		/^Tracks:/ { tracks = $2 + 0 }
+		/^fdcsim:/ { revs = $9 }
+		/^replay:/ { secs = $(NF-2) }
+		END {
+			if (revs == "" && secs != "")
+				revs = secs / 0.2	# replay: 300 rpm
+			sub(/^\(/, "", revs)
+			printf "%s\t%s\t%s\t%d\t%d\t%d\t%.1f\t%.2f\t%s\t%s\n",
+				image, tool, mode, tracks, ioctls, cmds, revs,
+				tracks ? revs / tracks : 0, wall, cpu
+		}' "$tmp/log"
+}
+
+bench() {
+	local image mode trace opts
+
+	printf "image\ttool\tmode\ttracks\tioctls\tcommands\trevolutions\trevs/track\twall\tcpu\n"
+	for image in "${IMAGES[@]}"; do
+		"$BIN/dskgen" "$image" "$tmp/$image.dsk" || exit 1
+		for mode in "${READ_MODES[@]}"; do
+			run "$image" dskread "$mode" "$BIN/dskread" \
+				-I "$tmp/$image.dsk" -e ${READ_OPTS[$image]} $mode \
+				"$tmp/out.dsk"
+		done
+		for mode in "${WRITE_MODES[@]}"; do
+			run "$image" dskwrite "$mode" "$BIN/dskwrite" \
+				-I "$tmp/blank.dsk" $mode "$tmp/$image.dsk"
+		done
+	done
+	for trace in "$@"; do
+		opts=
+		case "$trace" in
+			*:*) opts=${trace#*:}; trace=${trace%%:*};;
+		esac
+		run "$(basename "$trace")" dskread "$opts" "$BIN/dskread" \
+			-X "$trace" -e $opts "$tmp/out.dsk"
+	done
+}
+
+if [ -z "$baseline" ]; then
+	bench "$@"
+	exit 0
+fi
+
+bench "$@" | tee "$tmp/bench.tsv"
+awk -F '\t' -v tol="$TOLERANCE" -v cpu="$CPU" '
+	function worse(old, new, pct) {
+		return old != "-" && new > old * (1 + pct / 100)
+	}
+	FNR == 1 { next }
+	NR == FNR { base[$1 FS $2 FS $3] = $0; next }
+	{
+		key = $1 FS $2 FS $3
+		if (!(key in base))
+			next
+		split(base[key], old, FS)
+		if (worse(old[5], $5, tol))
+			msg = msg sprintf("%s %s %s: ioctls %s -> %s\n",
+				$1, $2, $3, old[5], $5)
+		if (worse(old[7], $7, tol))
+			msg = msg sprintf("%s %s %s: revolutions %s -> %s\n",
+				$1, $2, $3, old[7], $7)
+		if ($10 > 0.01 && worse(old[10], $10, cpu))
+			msg = msg sprintf("%s %s %s: cpu %s -> %s s\n",
+				$1, $2, $3, old[10], $10)
+	}
+	END {
+		if (msg != "") {
+			printf "Regressions against the baseline:\n%s", msg > "/dev/stderr"
+			exit 1
+		}
+	}' "$baseline" "$tmp/bench.tsv"
@@ -0,0 +1,306 @@
+/* $Id$
+ *
+ * checkpoint.c - Checkpointed images that dskread can resume.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "checkpoint.h"
+
+#include <sys/stat.h>
+
+int flag_resume = FALSE;	// continue an interrupted read
+
+/* Sectors of a track that could not be read, deleted data is fine */
+static unsigned long failed_sectors(Trackinfo *trackinfo) {
+
+	Sectorinfo *sectorinfo;
+	unsigned long failed = 0;
+	int j;
+
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (sectorinfo->err1 || (sectorinfo->err2 & ~ST2_CM))
+			failed |= 1UL << j;
+	}
+	return failed;
+}
+
+static void sync_file(FILE *file, char *what) {
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+		perror(what);
+		exit(1);
+	}
+}
+
+/* Append the line of track n to the sidecar, it is flushed by sync_file() */
+static void append(Checkpoint *ckp, int n) {
+
+	fprintf(ckp->file, "track %d %ld %ld %lx\n", n, ckp->offset[n],
+		ckp->size[n], ckp->failed[n]);
+}
+
+/* Read the sidecar of an earlier run, returns FALSE if there is none */
+static int load(Checkpoint *ckp, char *filename, int heads, int extended) {
+
+	FILE *in;
+	struct stat st;
+	char magic[32];
+	int version, h, e, n;
+	long offset, size;
+	unsigned long failed;
+
+	if (stat(filename, &st) != 0)
+		return FALSE;
+	in = fopen(ckp->path, "r");
+	if (in == NULL)
+		return FALSE;
+	if (fscanf(in, "%31s %d %d %d", magic, &version, &h, &e) != 4 ||
+		strcmp(magic, CHECKPOINT_MAGIC) != 0 ||
+		version != CHECKPOINT_VERSION) {
+		fclose(in);
+		myabort("Error resuming: Invalid checkpoint\n");
+	}
+	if (h != heads || !e != !extended) {
+		fclose(in);
+		myabort("Error resuming: Checkpoint of another format, give the "
+			"same options as before\n");
+	}
+
+	ckp->ntracks = 0;
+	while (fscanf(in, " track %d %ld %ld %lx", &n, &offset, &size,
+		&failed) == 4) {
+		if (n < 0 || n > ckp->ntracks || n >= 0xCC ||
+			offset + size > st.st_size)
+			break;
+		ckp->offset[n] = offset;
+		ckp->size[n] = size;
+		ckp->failed[n] = failed;
+		if (n == ckp->ntracks)
+			ckp->ntracks++;
+	}
+	fclose(in);
+	return TRUE;
+}
+
+/* Write the sidecar anew with the tracks kept */
+static void rewrite(Checkpoint *ckp, int heads, int extended) {
+
+	char tmp[1040];
+	int n;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ckp->path);
+	ckp->file = fopen(tmp, "w");
+	if (ckp->file == NULL) {
+		perror("Error writing checkpoint");
+		exit(1);
+	}
+	fprintf(ckp->file, "%s %d %d %d\n", CHECKPOINT_MAGIC,
+		CHECKPOINT_VERSION, heads, extended ? 1 : 0);
+	for (n=0; n<ckp->ntracks; n++)
+		fprintf(ckp->file, "track %d %ld %ld %lx\n", n, ckp->offset[n],
+			ckp->size[n], ckp->failed[n]);
+	sync_file(ckp->file, "Error writing checkpoint");
+	if (rename(tmp, ckp->path) != 0) {
+		perror("Error writing checkpoint");
+		exit(1);
+	}
+}
+
+Checkpoint *checkpoint_open(char *filename, int heads, int extended,
+	int resume) {
+
+	Checkpoint *ckp;
+	long end = sizeof(Diskinfo);
+	int n;
+
+	ckp = calloc(1, sizeof(*ckp));
+	if (ckp == NULL)
+		myabort("Error opening image file: Out of memory\n");
+	snprintf(ckp->path, sizeof(ckp->path), "%s.ckp", filename);
+
+	if (resume && load(ckp, filename, heads, extended)) {
+		/* a half read cylinder is read again */
+		ckp->ntracks -= ckp->ntracks % heads;
+		if (ckp->ntracks > 0)
+			end = ckp->offset[ckp->ntracks-1] +
+				ckp->size[ckp->ntracks-1];
+		ckp->writer = dskwriter_resume(filename, heads, extended,
+			ckp->ntracks, end);
+		for (n=0; extended && n<ckp->ntracks; n++)
+			ckp->writer->diskinfo.tracklenhigh[n] = ckp->size[n] >> 8;
+	} else {
+		if (resume)
+			fprintf(stderr, "No checkpoint for %s, reading it from "
+				"the start\n", filename);
+		ckp->ntracks = 0;
+		ckp->writer = dskwriter_open(filename, heads, extended);
+		dskwriter_sync(ckp->writer);
+	}
+	rewrite(ckp, heads, extended);
+	return ckp;
+}
+
+void checkpoint_track(Checkpoint *ckp, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	int n = ckp->ntracks;
+
+	if (n >= 0xCC)
+		myabort("Error writing Track: Too many tracks\n");
+	ckp->offset[n] = ftell(ckp->writer->file);
+	dskwriter_track(ckp->writer, trackinfo, data, len);
+	dskwriter_sync(ckp->writer);
+	ckp->size[n] = ftell(ckp->writer->file) - ckp->offset[n];
+	ckp->failed[n] = failed_sectors(trackinfo);
+	ckp->ntracks++;
+	append(ckp, n);
+	sync_file(ckp->file, "Error writing checkpoint");
+}
+
+int checkpoint_load(Checkpoint *ckp, int n, Trackinfo *trackinfo,
+	unsigned char *data) {
+
+	FILE *file = ckp->writer->file;
+	int len;
+
+	memset(trackinfo, 0, sizeof(*trackinfo));
+	if (ckp->size[n] == 0)
+		return 0;	/* unformatted EDSK track */
+	if (fseek(file, ckp->offset[n], SEEK_SET) != 0 ||
+		fread(trackinfo, 1, sizeof(*trackinfo), file) != sizeof(*trackinfo))
+		myabort("Error reading Track-Info: File to short\n");
+	if (trackinfo->spt > 29)
+		myabort("Error reading Track-Info: Too many sectors\n");
+	len = dskimage_stored(trackinfo, ckp->writer->extended, NULL);
+	if (len > MAX_TRACKLEN || len > ckp->size[n] - sizeof(*trackinfo))
+		myabort("Error reading Track: Track too long\n");
+	if (fread(data, 1, len, file) != len)
+		myabort("Error reading Track: File to short\n");
+	if (fseek(file, 0, SEEK_END) != 0) {
+		perror("Error reading Track");
+		exit(1);
+	}
+	return len;
+}
+
+void checkpoint_patch(Checkpoint *ckp, int n, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	dskwriter_patch(ckp->writer, ckp->offset[n], trackinfo, data, len);
+	dskwriter_sync(ckp->writer);
+	ckp->failed[n] = failed_sectors(trackinfo);
+	append(ckp, n);
+	sync_file(ckp->file, "Error writing checkpoint");
+}
+
+/* Size of the Track-Info block of a track in the image */
+static long track_size(Checkpoint *ckp, int n, Trackinfo *trackinfo, int len) {
+
+	if (!ckp->writer->extended)
+		return ckp->size[n];
+	return trackinfo->spt ? sizeof(*trackinfo) + ((len + 0xFF) & ~0xFF) : 0;
+}
+
+void checkpoint_replace(Checkpoint *ckp, int count, int *n,
+	Trackinfo **trackinfo, unsigned char **data, int *len) {
+
+	Dskwriter *writer = ckp->writer;
+	Trackinfo *tail;
+	unsigned char *data_tail;
+	int *len_tail;
+	int i, k, first, ntracks = ckp->ntracks;
+
+	/* the first track that changes its size, all after it move */
+	for (k=0, first=ntracks; k<count; k++) {
+		if (n[k] < first && track_size(ckp, n[k], trackinfo[k], len[k])
+			!= ckp->size[n[k]])
+			first = n[k];
+	}
+
+	/* the tracks before it are written in place */
+	for (k=0; k<count; k++) {
+		if (n[k] >= first)
+			continue;
+		dskwriter_patch(writer, ckp->offset[n[k]], trackinfo[k], data[k],
+			len[k]);
+		ckp->failed[n[k]] = failed_sectors(trackinfo[k]);
+	}
+	dskwriter_sync(writer);
+	for (k=0; k<count; k++)
+		if (n[k] < first)
+			append(ckp, n[k]);
+	sync_file(ckp->file, "Error writing checkpoint");
+	if (first == ntracks)
+		return;
+
+	/* load the tail with the replaced tracks in it */
+	tail = malloc((ntracks - first) * sizeof(*tail));
+	data_tail = malloc((ntracks - first) * MAX_TRACKLEN);
+	len_tail = malloc((ntracks - first) * sizeof(*len_tail));
+	if (tail == NULL || data_tail == NULL || len_tail == NULL)
+		myabort("Error writing Track: Out of memory\n");
+	for (i=0; i<ntracks-first; i++) {
+		for (k=0; k<count && n[k] != first + i; k++)
+			;
+		if (k < count) {
+			tail[i] = *trackinfo[k];
+			memcpy(data_tail + i * MAX_TRACKLEN, data[k], len[k]);
+			len_tail[i] = len[k];
+		} else {
+			len_tail[i] = checkpoint_load(ckp, first + i, &tail[i],
+				data_tail + i * MAX_TRACKLEN);
+		}
+	}
+
+	/* and write it again at once, until it is synced a resume reads
+	   these tracks anew */
+	ckp->ntracks = first;
+	fclose(ckp->file);
+	rewrite(ckp, writer->heads, writer->extended);
+	dskwriter_truncate(writer, first, ckp->offset[first]);
+	for (i=0; i<ntracks-first; i++) {
+		ckp->offset[first + i] = ftell(writer->file);
+		dskwriter_track(writer, &tail[i], data_tail + i * MAX_TRACKLEN,
+			len_tail[i]);
+		ckp->size[first + i] = ftell(writer->file) - ckp->offset[first + i];
+		ckp->failed[first + i] = failed_sectors(&tail[i]);
+	}
+	dskwriter_sync(writer);
+	for (i=0; i<ntracks-first; i++)
+		append(ckp, ckp->ntracks++);
+	sync_file(ckp->file, "Error writing checkpoint");
+	free(tail);
+	free(data_tail);
+	free(len_tail);
+}
+
+int checkpoint_close(Checkpoint *ckp) {
+
+	int n, j, failed = 0;
+
+	dskwriter_close(ckp->writer);
+	for (n=0; n<ckp->ntracks; n++)
+		for (j=0; j<29; j++)
+			if (ckp->failed[n] & (1UL << j))
+				failed++;
+	fclose(ckp->file);
+	if (failed == 0 && unlink(ckp->path) != 0)
+		perror("Error removing checkpoint");
+	free(ckp);
+	return failed;
+}
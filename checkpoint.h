@@ -0,0 +1,95 @@
+/* $Id$
+ *
+ * checkpoint.h - Checkpointed images that dskread can resume.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "common.h"
+#include "dskimage.h"
+
+/* Checkpoints
+ *
+ * Every track read is appended to the image and flushed to the disk, then
+ * a line for it is appended to a sidecar file <image>.ckp and flushed as
+ * well. After an interruption the image holds every track the sidecar
+ * lists, whatever came after is cut off when resuming.
+ *
+ * Sidecar file, text:
+ *
+ *	dsktools-checkpoint <version> <heads> <extended>
+ *
+ * followed by a line per track in image order
+ *
+ *	track <n> <offset> <size> <failed>
+ *
+ * with the offset and length of its Track-Info block in the image and a
+ * hex mask of the sectors that failed, bit j for sector j of the Track-Info.
+ * When a track is patched later another line for it follows, the last one
+ * counts. The sidecar is removed once no sector has failed.
+ */
+#define CHECKPOINT_MAGIC	"dsktools-checkpoint"
+#define CHECKPOINT_VERSION	1
+
+extern int flag_resume;		/* continue an interrupted read */
+
+typedef struct checkpoint_t {
+	char path[1024];	/* sidecar */
+	FILE *file;
+	Dskwriter *writer;
+	int ntracks;		/* tracks checkpointed */
+	long offset[0xCC];	/* Track-Info block of each track */
+	long size[0xCC];
+	unsigned long failed[0xCC];	/* mask of failed sectors per track */
+} Checkpoint;
+
+/* Start the image filename with its sidecar. With resume the tracks of an
+ * earlier run are kept, up to the last complete cylinder, and the reading
+ * goes on at ckp->ntracks / heads.
+ */
+Checkpoint *checkpoint_open(char *filename, int heads, int extended,
+	int resume);
+
+/* Append a track to the image and checkpoint it */
+void checkpoint_track(Checkpoint *ckp, Trackinfo *trackinfo,
+	unsigned char *data, int len);
+
+/* Load checkpointed track n from the image into trackinfo and data,
+ * MAX_TRACKLEN bytes. Returns the length of the data.
+ */
+int checkpoint_load(Checkpoint *ckp, int n, Trackinfo *trackinfo,
+	unsigned char *data);
+
+/* Write checkpointed track n again after sectors were read again */
+void checkpoint_patch(Checkpoint *ckp, int n, Trackinfo *trackinfo,
+	unsigned char *data, int len);
+
+/* Replace the checkpointed tracks n[0..count-1] by tracks that may have
+ * another size. Tracks before the first that changes its size are written
+ * in place, the image is rewritten from that one on in one go.
+ */
+void checkpoint_replace(Checkpoint *ckp, int count, int *n,
+	Trackinfo **trackinfo, unsigned char **data, int *len);
+
+/* Close the image, returns the number of sectors that failed. The sidecar
+ * is kept if there are any.
+ */
+int checkpoint_close(Checkpoint *ckp);
+
+#endif /* CHECKPOINT_H */
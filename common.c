@@ -19,6 +19,14 @@
  */
 
 #include "common.h"
+#include "fdcsim.h"
+#include "fdctrace.h"
+#include "stats.h"
+
+#include <time.h>
+#include <pthread.h>
+
+static void fdc_calibrated(int fd);
 
 void myabort(char *s)
 {
@@ -86,16 +94,29 @@ void init_raw_cmd(struct floppy_raw_cmd *raw_cmd)
 	raw_cmd->length = 0;
 	raw_cmd->phys_length = 0;
 	raw_cmd->buffer_length = 0;
+	raw_cmd->rate = 0;
 	raw_cmd->cmd_count = 0;
 	raw_cmd->reply_count = 0;
 	raw_cmd->resultcode = 0;	
 }
 
+unsigned short crc16(unsigned short crc, unsigned char *p, int len) {
+
+	int i;
+
+	while (len--) {
+		crc ^= *p++ << 8;
+		for (i=0; i<8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
 void reset(int fd) {
 
 	int err;
 
-	err = ioctl(fd, FDRESET);
+	err = fdc_reset(fd);
 	if (err < 0) {
 		perror("Error resetting fdc");
 		exit(1);
@@ -108,6 +129,11 @@ void recalibrate(int fd, int drive) {
 	int i, err;
 	struct floppy_raw_cmd raw_cmd;
 	unsigned char mask = 0xFF;
+	Head *head = fdc_head(fd);
+	long long start = fdc_now(fd);
+
+	head->recals++;
+	head->cyl = -1;
 
 	/* some floppy disc controllers will seek a maximum of 77 tracks
 	   for a reclibrate command. This is not sufficient if the 
@@ -138,8 +164,8 @@ void recalibrate(int fd, int drive) {
 	raw_cmd.flags = FD_RAW_INTR;
 	raw_cmd.length = 0;
 	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);			
+	err = fdc_rawcmd(fd, &raw_cmd);
 	if (err < 0) {
 		perror("Error recalibrating");
 		exit(1);
@@ -158,16 +184,20 @@ void recalibrate(int fd, int drive) {
 	raw_cmd.flags = 0;
 	raw_cmd.length = 0;
 	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+	err = fdc_rawcmd(fd, &raw_cmd);
 	if (err<0)
 	{
 		perror("Error recalibrating");
 		exit(1);
 	}
 	/* at track 0? */
-	if (raw_cmd.reply[0] & ST3_TZ)
+	if (raw_cmd.reply[0] & ST3_TZ) {
+		fdc_calibrated(fd);
+		head->cyl = 0;
+		head->usec += fdc_now(fd) - start;
 		return;
+	}
 
 
 	/* no */
@@ -177,8 +207,8 @@ void recalibrate(int fd, int drive) {
 	raw_cmd.flags = FD_RAW_INTR;
 	raw_cmd.length = 0;
 	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);			
+	err = fdc_rawcmd(fd, &raw_cmd);
 	if (err < 0) {
 		perror("Error recalibrating");
 		exit(1);
@@ -189,8 +219,8 @@ void recalibrate(int fd, int drive) {
 	raw_cmd.flags = 0;
 	raw_cmd.length = 0;
 	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+	err = fdc_rawcmd(fd, &raw_cmd);
 	if (err<0)
 	{
 		perror("Error recalibrating");
@@ -198,8 +228,12 @@ void recalibrate(int fd, int drive) {
 	}
 
 	/* at track 0? */
-	if (raw_cmd.reply[0] & ST3_TZ)
+	if (raw_cmd.reply[0] & ST3_TZ) {
+		fdc_calibrated(fd);
+		head->cyl = 0;
+		head->usec += fdc_now(fd) - start;
 		return;
+	}
 
 	/* if recalibrate failed a second time:
 	- disc drive is broken
@@ -210,11 +244,556 @@ void recalibrate(int fd, int drive) {
 	exit(1);
 }
 
+/* Relative seeks came with the 82077, which answers VERSION with 0x90 */
+static int has_rseek(int fd, int drive) {
+
+	struct floppy_raw_cmd raw_cmd;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_VERSION;
+	if (fdc_rawcmd(fd, &raw_cmd) < 0 || raw_cmd.reply_count == 0)
+		return FALSE;
+	return raw_cmd.reply[0] == 0x90;
+}
+
+void seek(int fd, int drive, int track)
+{
+	int err, steps;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+	Head *head = fdc_head(fd);
+	long long start;
+
+	/* a reset by another drive on the controller zeroed its idea of
+	   where the head is, SEEK would step to the wrong track */
+	if (fdc_stale(fd))
+		recalibrate(fd, drive);
+
+	if (head->cyl == track) {
+		head->skipped++;
+		return;
+	}
+	if (head->rseek < 0)
+		head->rseek = has_rseek(fd, drive);
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.track = track;
+	raw_cmd.rate  = 0;
+	raw_cmd.length= 0;
+
+	if (head->rseek && head->cyl >= 0) {
+		/* step from where the head is, the controller's idea of the
+		   cylinder doesn't matter */
+		steps = track - head->cyl;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = steps > 0 ?
+			FD_RSEEK_IN : FD_RSEEK_OUT;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+		raw_cmd.cmd[raw_cmd.cmd_count++] = abs(steps);
+	} else {
+		steps = head->cyl >= 0 ? track - head->cyl : track;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_SEEK & mask;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+		raw_cmd.cmd[raw_cmd.cmd_count++] = track;
+	}
+
+	start = fdc_now(fd);
+	err = fdc_rawcmd(fd, &raw_cmd);
+	head->usec += fdc_now(fd) - start;
+	head->seeks++;
+	head->steps += abs(steps);
+
+	if (err<0) {
+		printf("error");
+		head->cyl = -1;
+	} else {
+		head->cyl = track;
+	}
+}
+
+void seek_summary(FILE *out, int fd) {
+
+	Head *head = fdc_head(fd);
+
+	fprintf(out, "Seeks: %ld (%ld tracks stepped), %ld not needed, "
+		"%ld recalibrates, %.2f s\n", head->seeks, head->steps,
+		head->skipped, head->recals, head->usec / 1000000.0);
+}
+
+/* Measure the turnaround time of one FDRAWCMD ioctl in usec. SENSE DRIVE
+ * STATUS doesn't touch the disk, so its duration is pure driver overhead.
+ */
+long ioctl_latency(int fd, int drive) {
+
+	int i, err;
+	long t, best = -1;
+	long long start;
+	struct floppy_raw_cmd raw_cmd;
+
+	for (i=0; i<3; i++) {
+		init_raw_cmd(&raw_cmd);
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+		start = fdc_now(fd);
+		err = fdc_rawcmd(fd, &raw_cmd);
+		if (err < 0) {
+			perror("Error getting drive status");
+			exit(1);
+		}
+		t = fdc_now(fd) - start;
+		if (best < 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
 void init(int fd, int drive) {
 
+	/* a profiled drive is known to take commands right away */
 	reset( fd );
-	usleep( 100 );
+	if (!fdc_profile(fd)->probed)
+		fdc_sleep( fd, 100 );
 	recalibrate( fd,drive);
-	usleep( 100 );
+	if (!fdc_profile(fd)->probed)
+		fdc_sleep( fd, 100 );
 }
 
+/* Retry policy */
+
+static char *retry_names[RETRY_LEVELS] = {
+	"reread", "rotate", "reseek", "recalibrate"
+};
+
+static int retry_tries[RETRY_LEVELS] = { 2, 2, 2, 2 };
+
+/* per FDC handle, cleared when it is opened */
+static struct retry_stats_t {
+	long count[RETRY_LEVELS];	/* retries per level */
+	long long usec[RETRY_LEVELS];	/* time spent per level */
+	long recovered[RETRY_LEVELS];	/* sectors recovered per level */
+	long failed;			/* sectors given up */
+} retry_stats[MAX_FDC];
+
+int retry_policy(char *spec) {
+
+	int i, n;
+	char *end;
+
+	for (i=0; i<RETRY_LEVELS; i++) {
+		n = strtol(spec, &end, 0);
+		if (end == spec || n < 0)
+			return FALSE;
+		retry_tries[i] = n;
+		if (*end == 0 && i == RETRY_LEVELS-1)
+			return TRUE;
+		if (*end != ',')
+			return FALSE;
+		spec = end + 1;
+	}
+	return FALSE;
+}
+
+void retry_init(Retry *retry, int fd) {
+	memset(retry, 0, sizeof(*retry));
+}
+
+/* account the time since the last retry started to its level */
+static void retry_account(Retry *retry, int fd) {
+
+	if (retry->count > 0)
+		retry_stats[fd].usec[retry->level] += fdc_now(fd) - retry->mark;
+}
+
+int retry_next(Retry *retry, int fd, int drive, int track) {
+
+	retry_account(retry, fd);
+	while (retry->level < RETRY_LEVELS &&
+		retry->tries >= retry_tries[retry->level]) {
+		retry->level++;
+		retry->tries = 0;
+	}
+	if (retry->level == RETRY_LEVELS) {
+		retry_stats[fd].failed++;
+		return FALSE;
+	}
+
+	retry->mark = fdc_now(fd);
+	stats_retry(fd, track);
+	retry->tries++;
+	retry->count++;
+	retry_stats[fd].count[retry->level]++;
+
+	switch (retry->level) {
+		case RETRY_ROTATE:
+			fdc_sleep(fd, fdc_profile(fd)->rev_usec);
+			break;
+		case RETRY_RESEEK:
+			seek(fd, drive, track > 0 ? track - 1 : track + 1);
+			seek(fd, drive, track);
+			break;
+		case RETRY_RECAL:
+			recalibrate(fd, drive);
+			seek(fd, drive, track);
+			break;
+	}
+	return TRUE;
+}
+
+void retry_end(Retry *retry, int fd, int ok) {
+
+	if (retry->count == 0 || retry->level == RETRY_LEVELS)
+		return;
+	retry_account(retry, fd);
+	if (ok)
+		retry_stats[fd].recovered[retry->level]++;
+}
+
+void retry_summary(FILE *out, int fd) {
+
+	int i;
+	struct retry_stats_t *stats = &retry_stats[fd];
+	long total = stats->failed;
+
+	for (i=0; i<RETRY_LEVELS; i++)
+		total += stats->count[i];
+	if (total == 0)
+		return;
+
+	fprintf(out, "Retries:");
+	for (i=0; i<RETRY_LEVELS; i++) {
+		fprintf(out, " %s %ld (%ld recovered, %.2f s)%s",
+			retry_names[i], stats->count[i],
+			stats->recovered[i], stats->usec[i] / 1000000.0,
+			i < RETRY_LEVELS-1 ? "," : "\n");
+	}
+	fprintf(out, "Sectors failed: %ld\n", stats->failed);
+}
+
+
+/* FDC handles */
+
+static struct fdc_t {
+	Fdc_backend *backend;
+	void *priv;
+	int drive;
+	int resets;	/* controller resets seen at the last recalibrate */
+	Profile profile;
+	Head head;
+} fdcs[MAX_FDC];
+
+static pthread_mutex_t fdcs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* one entry per MAX_CONTROLLERS */
+static struct controller_t {
+	pthread_mutex_t lock;	/* held while a command chain runs */
+	int resets;
+} controllers[MAX_CONTROLLERS] = {
+	{ PTHREAD_MUTEX_INITIALIZER, 0 },
+	{ PTHREAD_MUTEX_INITIALIZER, 0 }
+};
+
+int fdc_register(Fdc_backend *backend, void *priv, int drive) {
+
+	int i;
+
+	if (drive < 0 || drive >= MAX_FDC)
+		myabort("Error opening fdc: No such drive\n");
+
+	pthread_mutex_lock(&fdcs_lock);
+	for (i=0; i<MAX_FDC; i++) {
+		if (fdcs[i].backend == NULL) {
+			fdcs[i].backend = backend;
+			fdcs[i].priv = priv;
+			fdcs[i].drive = drive;
+			fdcs[i].resets = controllers[FDC_CONTROLLER(drive)].resets;
+			memset(&fdcs[i].profile, 0, sizeof(fdcs[i].profile));
+			fdcs[i].profile.rate = 2;
+			fdcs[i].profile.rev_usec = REV_USEC;
+			memset(&fdcs[i].head, 0, sizeof(fdcs[i].head));
+			fdcs[i].head.cyl = -1;
+			fdcs[i].head.rseek = -1;
+			memset(&retry_stats[i], 0, sizeof(retry_stats[i]));
+			pthread_mutex_unlock(&fdcs_lock);
+			stats_open(i, drive);
+			return i;
+		}
+	}
+	pthread_mutex_unlock(&fdcs_lock);
+	myabort("Error opening fdc: Too many drives\n");
+	return -1;
+}
+
+static struct controller_t *controller(int fd) {
+	return &controllers[FDC_CONTROLLER(fdcs[fd].drive)];
+}
+
+/* Linux floppy driver backend */
+
+static int linux_rawcmd(void *priv, struct floppy_raw_cmd *raw_cmd) {
+	return ioctl(*(int *) priv, FDRAWCMD, raw_cmd);
+}
+
+static int linux_reset(void *priv) {
+	return ioctl(*(int *) priv, FDRESET);
+}
+
+static long long linux_now(void *priv) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void linux_sleep(void *priv, long usec) {
+	usleep(usec);
+}
+
+static void linux_close(void *priv) {
+	close(*(int *) priv);
+	free(priv);
+}
+
+static int linux_drvstat(void *priv, struct floppy_drive_struct *drvstat) {
+	return ioctl(*(int *) priv, FDPOLLDRVSTAT, drvstat);
+}
+
+static Fdc_backend linux_backend = {
+	"linux", linux_rawcmd, linux_reset, linux_now, linux_sleep, linux_close,
+	linux_drvstat
+};
+
+void fdc_interpose(int fd, Fdc_backend *backend, void *priv,
+	Fdc_backend **inner, void **inner_priv) {
+
+	pthread_mutex_lock(&fdcs_lock);
+	*inner = fdcs[fd].backend;
+	*inner_priv = fdcs[fd].priv;
+	fdcs[fd].backend = backend;
+	fdcs[fd].priv = priv;
+	pthread_mutex_unlock(&fdcs_lock);
+}
+
+int fdc_open(int drive, char *sim) {
+
+	char device[32];
+	int *dev, fd;
+
+	if (flag_replay != NULL)
+		return fdctrace_replay(flag_replay, drive);
+
+	if (sim != NULL) {
+		fd = fdcsim_open(sim, drive);
+	} else {
+		sprintf(device, "/dev/fd%01d", drive);
+		dev = malloc(sizeof(*dev));
+		*dev = open(device, O_ACCMODE | O_NDELAY);
+		if (*dev < 0) {
+			perror("Error opening floppy device");
+			exit(1);
+		}
+		fd = fdc_register(&linux_backend, dev, drive);
+	}
+	if (flag_record != NULL)
+		fdctrace_record(fd, flag_record, drive);
+	return fd;
+}
+
+int fdc_rawcmd(int fd, struct floppy_raw_cmd *raw_cmd) {
+
+	struct controller_t *c = controller(fd);
+	int err;
+	long long start, end;
+
+	pthread_mutex_lock(&c->lock);
+	start = fdc_now(fd);
+	err = fdcs[fd].backend->rawcmd(fdcs[fd].priv, raw_cmd);
+	end = fdc_now(fd);
+	pthread_mutex_unlock(&c->lock);
+	stats_ioctl(fd, raw_cmd, start, end);
+
+	/* the driver seeks for commands that ask it to */
+	for (;;) {
+		if (raw_cmd->flags & FD_RAW_NEED_SEEK)
+			fdcs[fd].head.cyl = err < 0 ? -1 : raw_cmd->track;
+		if (!(raw_cmd->flags & FD_RAW_MORE))
+			break;
+		raw_cmd++;
+	}
+	return err;
+}
+
+int fdc_reset(int fd) {
+
+	struct controller_t *c = controller(fd);
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+	err = fdcs[fd].backend->reset(fdcs[fd].priv);
+	c->resets++;
+	pthread_mutex_unlock(&c->lock);
+	return err;
+}
+
+int fdc_stale(int fd) {
+	return fdcs[fd].resets != controller(fd)->resets;
+}
+
+/* the head position is known again after recalibrating */
+static void fdc_calibrated(int fd) {
+	fdcs[fd].resets = controller(fd)->resets;
+}
+
+long long fdc_now(int fd) {
+	return fdcs[fd].backend->now(fdcs[fd].priv);
+}
+
+void fdc_sleep(int fd, long usec) {
+	fdcs[fd].backend->sleep(fdcs[fd].priv, usec);
+}
+
+Profile *fdc_profile(int fd) {
+	return &fdcs[fd].profile;
+}
+
+Head *fdc_head(int fd) {
+	return &fdcs[fd].head;
+}
+
+char *fdc_backend_name(int fd) {
+	return fdcs[fd].backend->name;
+}
+
+int fdc_drvstat(int fd, struct floppy_drive_struct *drvstat) {
+
+	struct controller_t *c = controller(fd);
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+	err = fdcs[fd].backend->drvstat(fdcs[fd].priv, drvstat);
+	pthread_mutex_unlock(&c->lock);
+	return err;
+}
+
+void fdc_close(int fd) {
+	stats_close(fd);
+	fdcs[fd].backend->close(fdcs[fd].priv);
+	pthread_mutex_lock(&fdcs_lock);
+	fdcs[fd].backend = NULL;
+	pthread_mutex_unlock(&fdcs_lock);
+}
+
+/* Progress reports */
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static int report_prefix = FALSE;	/* several drives are busy */
+
+FILE *report_begin(Report *report) {
+
+	report->text = NULL;
+	report->len = 0;
+	report->out = open_memstream(&report->text, &report->len);
+	if (report->out == NULL)
+		myabort("Error reporting: Out of memory\n");
+	return report->out;
+}
+
+void report_end(Report *report, int fd) {
+
+	char *line, *next;
+
+	fclose(report->out);
+	pthread_mutex_lock(&report_lock);
+	for (line = report->text; *line; line = next) {
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		if (report_prefix)
+			fprintf(stderr, "fd%d: ", fdcs[fd].drive);
+		fwrite(line, 1, next - line, stderr);
+	}
+	fflush(stderr);
+	pthread_mutex_unlock(&report_lock);
+	free(report->text);
+}
+
+/* Jobs */
+
+typedef struct worker_t {
+	pthread_t thread;
+	int drive;
+	Job *jobs;
+	int njobs;
+	void (*run)(Job *job);
+	long long usec;
+} Worker;
+
+int job_parse(Job *job, char *spec) {
+
+	char *end;
+
+	job->drive = strtol(spec, &end, 10);
+	if (end == spec || *end != ':' || job->drive < 0 ||
+		job->drive >= MAX_FDC)
+		return FALSE;
+	job->image = end + 1;
+	job->sim = strchr(job->image, ':');
+	if (job->sim != NULL)
+		*job->sim++ = 0;
+	job->usec = 0;
+	return *job->image != 0;
+}
+
+static void *job_thread(void *arg) {
+
+	Worker *worker = arg;
+	int i;
+
+	for (i=0; i<worker->njobs; i++) {
+		if (worker->jobs[i].drive != worker->drive)
+			continue;
+		worker->run(&worker->jobs[i]);
+		worker->usec += worker->jobs[i].usec;
+	}
+	return NULL;
+}
+
+void jobs_run(Job *jobs, int njobs, void (*run)(Job *job)) {
+
+	Worker workers[MAX_FDC];
+	int i, j, nworkers = 0;
+	long long total = 0, longest = 0;
+
+	for (i=0; i<njobs; i++) {
+		for (j=0; j<nworkers; j++)
+			if (workers[j].drive == jobs[i].drive)
+				break;
+		if (j < nworkers)
+			continue;
+		memset(&workers[j], 0, sizeof(workers[j]));
+		workers[j].drive = jobs[i].drive;
+		workers[j].jobs = jobs;
+		workers[j].njobs = njobs;
+		workers[j].run = run;
+		nworkers++;
+	}
+
+	report_prefix = nworkers > 1;
+	for (j=0; j<nworkers; j++)
+		if (pthread_create(&workers[j].thread, NULL, job_thread,
+			&workers[j]) != 0)
+			myabort("Error starting jobs: Can't start drive thread\n");
+	for (j=0; j<nworkers; j++) {
+		pthread_join(workers[j].thread, NULL);
+		total += workers[j].usec;
+		if (workers[j].usec > longest)
+			longest = workers[j].usec;
+	}
+	report_prefix = FALSE;
+
+	for (j=0; j<nworkers; j++)
+		fprintf(stderr, "Drive %d: %.2f s\n", workers[j].drive,
+			workers[j].usec / 1000000.0);
+	fprintf(stderr, "%d jobs on %d drives in %.2f s (%.2f s one after "
+		"another)\n", njobs, nworkers, longest / 1000000.0,
+		total / 1000000.0);
+}
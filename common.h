@@ -47,6 +47,8 @@
 #define MAGIC_DISK "MV - CPC"
 #define MAGIC_DISK_WRITE "MV - CPCEMU / 27 Dec 01 01:11"
 #define MAGIC_EDISK "EXTENDED"
+#define MAGIC_EDISK_WRITE "EXTENDED CPC DSK File\r\nDisk-Info\r\n"
+#define CREATOR "dsktools"
 #define	TRACKS 40
 #define MAX_TRACKS 82
 #define MAX_SIDES 2
@@ -54,6 +56,7 @@
 #define TRACKLEN_INFO (TRACKLEN + 0x100)
 
 #define MAGIC_TRACK "Track-Info"
+#define MAGIC_TRACK_WRITE "Track-Info\r\n"
 #define HEAD 0
 #define BPS 2
 #define SPT 9
@@ -66,6 +69,9 @@
 
 #define MAX_TRACKLEN 0x2000
 
+#define REV_USEC 200000		/* one revolution at 300 rpm */
+#define TRACK_BYTES 6250	/* MFM bytes per revolution at 250 kbit/s */
+
 #define OFF_IBM 0x01
 #define OFF_SYS 0x41
 #define OFF_DAT 0xC1
@@ -125,6 +131,12 @@ void init_sectorinfo(Sectorinfo *sectorinfo, int track, int head, int sector);
 /* Initialise a raw FDC command */
 void init_raw_cmd(struct floppy_raw_cmd *raw_cmd);
 
+/* CRC-CCITT of len bytes as the FDC computes it over ID and data fields,
+ * start with 0xFFFF including the address mark. Over a field with its CRC
+ * the result is 0.
+ */
+unsigned short crc16(unsigned short crc, unsigned char *p, int len);
+
 /* Reset FDD */
 void reset(int fd);
 
@@ -133,5 +145,189 @@ void init(int fd, int drive);
 /* Recalibrate FDD to track 0 */
 void recalibrate(int fd, int drive);
 
+/* Seek FDD to track. Nothing is done if the head is there already, the
+ * controller steps relative to where the head is if it can.
+ */
+void seek(int fd, int drive, int track);
+
+/* Print the seeks done so far on fd */
+void seek_summary(FILE *out, int fd);
+
+/* Measure the turnaround time of one FDRAWCMD ioctl in usec */
+long ioctl_latency(int fd, int drive);
+
+/* FDC backends
+ *
+ * All raw FDC commands are submitted through fdc_rawcmd() instead of calling
+ * ioctl(FDRAWCMD) directly. An FDC handle ("fd" throughout dsktools) selects
+ * the backend: the Linux floppy driver or the simulated controller in
+ * fdcsim.c. Chains of commands flagged FD_RAW_MORE behave as for FDRAWCMD.
+ */
+#define MAX_FDC 8
+
+/* Drives 0-3 are on the first controller, 4-7 on the second one. Commands
+ * address a drive by its unit number on its controller. Controllers run
+ * one command chain at a time, fdc_rawcmd() serializes the drives sharing
+ * one.
+ */
+#define MAX_CONTROLLERS	(MAX_FDC / 4)
+#define FDC_UNIT(drive)	((drive) & 3)
+#define FDC_CONTROLLER(drive)	((drive) >> 2)
+
+typedef struct fdc_backend_t {
+	char *name;
+	int (*rawcmd)(void *priv, struct floppy_raw_cmd *raw_cmd);
+	int (*reset)(void *priv);
+	long long (*now)(void *priv);	/* monotonic time in usec */
+	void (*sleep)(void *priv, long usec);
+	void (*close)(void *priv);
+	int (*drvstat)(void *priv, struct floppy_drive_struct *drvstat);
+} Fdc_backend;
+
+/* Drive profile: timings and data rate of a drive, see profile.h. Until
+ * a profile is loaded or probed the nominal values are used.
+ */
+typedef struct profile_t {
+	int probed;		/* measured, not the nominal values */
+	int rate;		/* data rate code of double density disks */
+	long rev_usec;		/* one revolution */
+	long step_usec;		/* one head step */
+	long settle_usec;	/* seek overhead on top of the steps */
+	long latency;		/* ioctl turnaround */
+} Profile;
+
+/* Head position and seek statistics of a drive, kept by seek() and
+ * recalibrate(). Commands flagged FD_RAW_NEED_SEEK move the head as well.
+ */
+typedef struct head_t {
+	int cyl;		/* cylinder the head is on, -1 if unknown */
+	int rseek;		/* controller has relative seeks, -1 if unknown */
+	long seeks;		/* seeks issued */
+	long skipped;		/* seeks not needed, the head was there */
+	long recals;		/* recalibrates */
+	long steps;		/* tracks stepped by seeks */
+	long long usec;		/* time spent seeking and recalibrating */
+} Head;
+
+/* Register an opened backend for drive, returns the FDC handle */
+int fdc_register(Fdc_backend *backend, void *priv, int drive);
+
+/* Put backend with priv in front of the backend of fd, which is returned
+ * in *inner and *inner_priv for it to pass commands on to.
+ */
+void fdc_interpose(int fd, Fdc_backend *backend, void *priv,
+	Fdc_backend **inner, void **inner_priv);
+
+/* Open /dev/fd<drive>, or the simulated drive if sim is not NULL. With
+ * flag_replay the trace is opened instead, with flag_record the traffic is
+ * recorded (see fdctrace.h).
+ */
+int fdc_open(int drive, char *sim);
+
+int fdc_rawcmd(int fd, struct floppy_raw_cmd *raw_cmd);
+
+int fdc_reset(int fd);
+
+long long fdc_now(int fd);
+
+void fdc_sleep(int fd, long usec);
+
+/* Poll the drive state as FDPOLLDRVSTAT does */
+int fdc_drvstat(int fd, struct floppy_drive_struct *drvstat);
+
+/* The profile of the drive of fd */
+Profile *fdc_profile(int fd);
+
+/* The head of the drive of fd */
+Head *fdc_head(int fd);
+
+/* Name of the backend of fd */
+char *fdc_backend_name(int fd);
+
+void fdc_close(int fd);
+
+/* TRUE if another drive reset the controller since fd last recalibrated,
+ * the controller has lost the head position then.
+ */
+int fdc_stale(int fd);
+
+/* Retry policy
+ *
+ * A failed sector is retried with escalating measures, each level is tried
+ * as often as the policy says before moving on to the next one:
+ * reissuing the command, waiting a revolution first, stepping off the
+ * track and back, and recalibrating as a last resort. Retries and the time
+ * they took are counted per level.
+ */
+#define RETRY_REREAD	0	/* issue the command again */
+#define RETRY_ROTATE	1	/* wait one revolution, then issue it again */
+#define RETRY_RESEEK	2	/* step to the next track and back */
+#define RETRY_RECAL	3	/* recalibrate and seek back */
+#define RETRY_LEVELS	4
+
+typedef struct retry_t {
+	int level;		/* level of the next retry */
+	int tries;		/* retries done at that level */
+	int count;		/* retries done for this sector */
+	long long mark;		/* fdc_now() when the last retry started */
+} Retry;
+
+/* Set the policy from "reread,rotate,reseek,recal" retry counts, returns
+ * FALSE if spec is invalid.
+ */
+int retry_policy(char *spec);
+
+void retry_init(Retry *retry, int fd);
+
+/* Called after a failed attempt: takes the next measure of the policy.
+ * Returns FALSE if all retries are used up.
+ */
+int retry_next(Retry *retry, int fd, int drive, int track);
+
+/* Called after the last attempt, succeeded or not */
+void retry_end(Retry *retry, int fd, int ok);
+
+/* Print the retries done so far on fd */
+void retry_summary(FILE *out, int fd);
+
+/* Progress reports
+ *
+ * Drives running in parallel share stderr. A report collects what is said
+ * about one track or image and prints it in one go, every line prefixed
+ * with the drive when more than one drive is busy.
+ */
+typedef struct report_t {
+	FILE *out;
+	char *text;
+	size_t len;
+} Report;
+
+/* Start a report, returns the stream to print it to */
+FILE *report_begin(Report *report);
+
+/* Print the report on behalf of fd */
+void report_end(Report *report, int fd);
+
+/* Jobs
+ *
+ * A job copies one image from or to one drive. jobs_run() starts a worker
+ * thread for every drive, which opens its own FDC handle per job. Jobs for
+ * the same drive run one after another in its worker.
+ */
+#define MAX_JOBS 64
+
+typedef struct job_t {
+	int drive;
+	char *image;
+	char *sim;		/* simulated disk, NULL for the real drive */
+	long long usec;		/* drive time the job took */
+} Job;
+
+/* Parse "<drive>:<image>[:<sim image>]", returns FALSE if spec is invalid */
+int job_parse(Job *job, char *spec);
+
+/* Run the jobs and print how long every drive was busy */
+void jobs_run(Job *jobs, int njobs, void (*run)(Job *job));
+
 #endif /* COMMON_H */
 
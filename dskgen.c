@@ -0,0 +1,212 @@
+/* $Id$
+ *
+ * dskgen.c - Generates synthetic CPC disk images for the dsktools benchmark.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+#include "dskimage.h"
+#include "fdcread.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fdreg.h>
+
+/* notes:
+ *
+ * every image is an EDSK image, so sectors keep their real size and weak
+ * sectors can be stored several times. The sector data is a pattern made
+ * of track, side and sector, so a wrong sector in an image read back
+ * shows up when comparing it with the generated one.
+ */
+
+typedef struct layout_t {
+	int count;		/* sectors */
+	int first;		/* first sector ID */
+	int n;			/* size code */
+	int gap;		/* gap 3 when formatting */
+} Layout;
+
+static Layout data_layout = { 9, 0xC1, 2, 0x52 };
+static Layout mixed[] = {
+	{ 9, 0xC1, 2, 0x52 },
+	{ 18, 0x01, 1, 0x0E },
+	{ 5, 0x01, 3, 0x40 },
+	{ 2, 0x01, 4, 0x52 },
+	{ 1, 0x01, 5, 0x52 },
+};
+#define MIXED_LAYOUTS (sizeof(mixed) / sizeof(mixed[0]))
+
+typedef struct kind_t {
+	char *name;
+	int tracks, heads;
+	char *help;
+} Kind;
+
+static Kind kinds[] = {
+	{ "data", 40, 1, "DATA format, 40 tracks of 9 sectors C1-C9" },
+	{ "system", 40, 1, "SYSTEM format, 40 tracks of 9 sectors 41-49" },
+	{ "data80", 80, 1, "DATA format on 80 tracks" },
+	{ "ds", 80, 2, "DATA format on 80 tracks, double sided" },
+	{ "mixed", 40, 1, "128 to 4096 byte sectors, also within a track" },
+	{ "prot", 40, 1, "DATA format with an unformatted track, CRC errors,\n"
+		"                      deleted data, weak sectors, 10 sectors and\n"
+		"                      IDs of another cylinder" },
+	{ NULL, 0, 0, NULL }
+};
+
+/* Append a sector, stored copies times with a few bytes varying */
+static int add_sector(Trackinfo *trackinfo, unsigned char *data, int len,
+	int c, int h, int r, int n, int st1, int st2, int copies) {
+
+	Sectorinfo *sectorinfo = &trackinfo->sectorinfo[trackinfo->spt++];
+	int size = sector_size(n);
+	int i, j;
+
+	init_sectorinfo(sectorinfo, c, h, r);
+	sectorinfo->bps = n;
+	sectorinfo->err1 = st1;
+	sectorinfo->err2 = st2;
+	if (copies > 1) {
+		sectorinfo->unused1 = (copies * size) & 0xFF;
+		sectorinfo->unused2 = (copies * size) >> 8;
+	}
+	for (i=0; i<copies; i++) {
+		for (j=0; j<size; j++)
+			data[len++] = (c*31 + h*7 + r*13 + j) & 0xFF;
+		if (i > 0)
+			memset(data + len - size/2, 0x55 * i, 16);
+	}
+	return len;
+}
+
+static int add_layout(Trackinfo *trackinfo, unsigned char *data, int len,
+	Layout *layout, int track, int side) {
+
+	int i;
+
+	trackinfo->bps = layout->n;
+	trackinfo->gap = layout->gap;
+	for (i=0; i<layout->count; i++)
+		len = add_sector(trackinfo, data, len, track, side,
+			layout->first + i, layout->n, 0, 0, 1);
+	return len;
+}
+
+/* Lay out one track of kind, returns the length of its data */
+static int make_track(Kind *kind, Trackinfo *trackinfo, unsigned char *data,
+	int track, int side) {
+
+	Layout layout = data_layout;
+	int i, len = 0;
+
+	init_trackinfo(trackinfo, track, side);
+	trackinfo->fill = 0xE5;
+
+	if (strcmp(kind->name, "system") == 0) {
+		layout.first = 0x41;
+	} else if (strcmp(kind->name, "mixed") == 0) {
+		if (track % (MIXED_LAYOUTS + 1) == MIXED_LAYOUTS) {
+			/* two 1024 and four 512 byte sectors */
+			trackinfo->gap = 0x2A;
+			for (i=0; i<6; i++)
+				len = add_sector(trackinfo, data, len, track, side,
+					0xC1 + i, i < 2 ? 3 : 2, 0, 0, 1);
+			trackinfo->bps = 3;
+			return len;
+		}
+		layout = mixed[track % (MIXED_LAYOUTS + 1)];
+	} else if (strcmp(kind->name, "prot") == 0) {
+		switch (track) {
+			case 5:
+				return 0;	/* unformatted */
+			case 9:
+				layout.count = 3;
+				len = add_layout(trackinfo, data, len, &layout, track, side);
+				len = add_sector(trackinfo, data, len, track, side,
+					0xC4, 2, ST1_CRC, ST2_CRC, 1);
+				layout.first = 0xC5;
+				layout.count = 5;
+				return add_layout(trackinfo, data, len, &layout, track, side);
+			case 11:
+				layout.count = 4;
+				len = add_layout(trackinfo, data, len, &layout, track, side);
+				len = add_sector(trackinfo, data, len, track, side,
+					0xC5, 2, ST1_CRC, ST2_CRC, 3);
+				layout.first = 0xC6;
+				layout.count = 4;
+				return add_layout(trackinfo, data, len, &layout, track, side);
+			case 13:
+				layout.count = 2;
+				len = add_layout(trackinfo, data, len, &layout, track, side);
+				len = add_sector(trackinfo, data, len, track, side,
+					0xC3, 2, 0, ST2_CM, 1);
+				layout.first = 0xC4;
+				layout.count = 6;
+				return add_layout(trackinfo, data, len, &layout, track, side);
+			case 15:
+				layout.count = 10;
+				layout.gap = 0x0A;
+				break;
+			case 17:
+				for (i=0; i<layout.count; i++)
+					len = add_sector(trackinfo, data, len, 0xFF, side,
+						layout.first + i, layout.n, 0, 0, 1);
+				return len;
+		}
+	}
+	return add_layout(trackinfo, data, len, &layout, track, side);
+}
+
+void help_exit(int exitcode) {
+
+	Kind *kind;
+
+	fprintf(stderr, "usage: dskgen <kind> <filename>\n");
+	fprintf(stderr, "kinds:\n");
+	for (kind=kinds; kind->name != NULL; kind++)
+		fprintf(stderr, "         %-12s %s\n", kind->name, kind->help);
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static unsigned char data[MAX_TRACKLEN];
+	Trackinfo trackinfo;
+	Dskwriter *writer;
+	Kind *kind;
+	int track, side, len;
+
+	if (argc != 3)
+		help_exit(argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : 1);
+	for (kind=kinds; kind->name != NULL; kind++)
+		if (strcmp(kind->name, argv[1]) == 0)
+			break;
+	if (kind->name == NULL)
+		help_exit(1);
+
+	writer = dskwriter_open(argv[2], kind->heads, TRUE);
+	for (track=0; track<kind->tracks; track++) {
+		for (side=0; side<kind->heads; side++) {
+			len = make_track(kind, &trackinfo, data, track, side);
+			dskwriter_track(writer, &trackinfo, data, len);
+		}
+	}
+	dskwriter_close(writer);
+	return 0;
+}
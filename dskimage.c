@@ -0,0 +1,414 @@
+/* $Id$
+ *
+ * dskimage.c - DSK and EDSK image files for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "dskimage.h"
+
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void init_diskinfo( Diskinfo *diskinfo, int tracks, int heads, int tracklen ) {
+
+	memset(diskinfo, 0, sizeof(*diskinfo));
+
+	strncpy( diskinfo->magic, MAGIC_DISK_WRITE, sizeof( diskinfo->magic ) );
+	diskinfo->tracks = tracks;
+	diskinfo->heads = heads;
+	diskinfo->tracklen[0] = (char) tracklen;
+	diskinfo->tracklen[1] = (char) (tracklen >> 8);
+	//unsigned char tracklenhigh[0xCC];
+
+}
+
+void timestamp_diskinfo( Diskinfo *diskinfo ) {
+
+	time_t t;
+	struct tm *ltime;
+
+	t = time(NULL);
+	ltime = localtime(&t);
+	/* FIXME: Can the formatting be messed up by locale settings? */
+	strftime( diskinfo->magic+14, 16, "%d %b %g %H:%M", ltime );
+
+}
+
+/* Rewrite the Disk-Info block, leaving the file position at the end */
+static void write_header(Dskwriter *writer) {
+
+	int count;
+
+	if (fseek(writer->file, 0, SEEK_SET) != 0) {
+		perror("Error writing Disk-Info");
+		exit(1);
+	}
+	count = fwrite(&writer->diskinfo, 1, sizeof(writer->diskinfo),
+		writer->file);
+	if (count != sizeof(writer->diskinfo)) {
+		myabort("Error writing Disk-Info: File to short\n");
+	}
+	if (fseek(writer->file, 0, SEEK_END) != 0 || fflush(writer->file) != 0) {
+		perror("Error writing Disk-Info");
+		exit(1);
+	}
+}
+
+Dskwriter *dskwriter_open(char *filename, int heads, int extended) {
+
+	Dskwriter *writer;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL)
+		myabort("Error opening image file: Out of memory\n");
+
+	writer->file = fopen(filename, "w+");
+	if (writer->file == NULL) {
+		perror("Error opening image file");
+		exit(1);
+	}
+	writer->extended = extended;
+	writer->heads = heads;
+	writer->tracklen = TRACKLEN;
+
+	/* no complete cylinder yet */
+	if (extended) {
+		init_diskinfo( &writer->diskinfo, 0, heads, 0 );
+		strncpy( writer->diskinfo.magic, MAGIC_EDISK_WRITE,
+			sizeof( writer->diskinfo.magic ) );
+		strncpy( (char *) writer->diskinfo.unused1, CREATOR,
+			sizeof( writer->diskinfo.unused1 ) );
+	} else {
+		init_diskinfo( &writer->diskinfo, 0, heads, writer->tracklen + 0x100 );
+		timestamp_diskinfo( &writer->diskinfo );
+	}
+	write_header(writer);
+	return writer;
+}
+
+/* Write an EDSK track at the file position: only the data read, padded to
+ * 256 bytes. Returns the length of the block, 0 for an unformatted track.
+ */
+static int write_etrack(Dskwriter *writer, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	static unsigned char zero[0x100];
+	Trackinfo info;
+	Sectorinfo *sectorinfo;
+	int j, size, count, pad;
+
+	/* unformatted track */
+	if (trackinfo->spt == 0)
+		return 0;
+
+	/* record the real size of each sector */
+	info = *trackinfo;
+	strncpy( info.magic, MAGIC_TRACK_WRITE, sizeof( info.magic ) );
+	for (j=0; j<info.spt; j++) {
+		sectorinfo = &info.sectorinfo[j];
+		if (sectorinfo->unused1 || sectorinfo->unused2)
+			continue;
+		size = sector_size(sectorinfo->bps);
+		sectorinfo->unused1 = size & 0xFF;
+		sectorinfo->unused2 = size >> 8;
+	}
+
+	pad = (0x100 - (len & 0xFF)) & 0xFF;
+	if ((sizeof(info) + len + pad) >> 8 > 0xFF)
+		myabort("Error writing Track: Track too long\n");
+
+	count = fwrite(&info, 1, sizeof(info), writer->file);
+	count += fwrite(data, 1, len, writer->file);
+	count += fwrite(zero, 1, pad, writer->file);
+	if (count != sizeof(info) + len + pad) {
+		myabort("Error writing Track: File to short\n");
+	}
+	return count;
+}
+
+/* Write a DSK track at the file position, returns the length of the block */
+static int write_track(Dskwriter *writer, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	static unsigned char zero[MAX_TRACKLEN];
+	int count;
+
+	count = fwrite(trackinfo, 1, sizeof(*trackinfo), writer->file);
+	if (count != sizeof(*trackinfo)) {
+		myabort("Error writing Track-Info: File to short\n");
+	}
+
+	/* DSK tracks all have the same size */
+	if (len > writer->tracklen) {
+		fprintf(stderr, "Warning: Track %d truncated to %d bytes, "
+			"use an EDSK image\n", trackinfo->track,
+			writer->tracklen);
+		len = writer->tracklen;
+	}
+	count = fwrite(data, 1, len, writer->file);
+	count += fwrite(zero, 1, writer->tracklen - len, writer->file);
+	if (count != writer->tracklen) {
+		myabort("Error writing Track: File to short\n");
+	}
+	return sizeof(*trackinfo) + count;
+}
+
+void dskwriter_track(Dskwriter *writer, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	int size;
+
+	if (writer->extended) {
+		if (writer->ntracks >= sizeof(writer->diskinfo.tracklenhigh))
+			myabort("Error writing Track: Too many tracks\n");
+		size = write_etrack(writer, trackinfo, data, len);
+		writer->diskinfo.tracklenhigh[writer->ntracks] = size >> 8;
+	} else {
+		write_track(writer, trackinfo, data, len);
+	}
+
+	writer->ntracks++;
+	if (writer->ntracks % writer->heads == 0) {
+		writer->diskinfo.tracks = writer->ntracks / writer->heads;
+		write_header(writer);
+	}
+}
+
+void dskwriter_patch(Dskwriter *writer, long offset, Trackinfo *trackinfo,
+	unsigned char *data, int len) {
+
+	if (fseek(writer->file, offset, SEEK_SET) != 0) {
+		perror("Error writing Track");
+		exit(1);
+	}
+	if (writer->extended)
+		write_etrack(writer, trackinfo, data, len);
+	else
+		write_track(writer, trackinfo, data, len);
+	if (fseek(writer->file, 0, SEEK_END) != 0) {
+		perror("Error writing Track");
+		exit(1);
+	}
+}
+
+void dskwriter_sync(Dskwriter *writer) {
+
+	if (fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0) {
+		perror("Error writing image file");
+		exit(1);
+	}
+}
+
+Dskwriter *dskwriter_resume(char *filename, int heads, int extended,
+	int ntracks, long end) {
+
+	Dskwriter *writer;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL)
+		myabort("Error opening image file: Out of memory\n");
+
+	writer->file = fopen(filename, "r+");
+	if (writer->file == NULL) {
+		perror("Error opening image file");
+		exit(1);
+	}
+	if (fread(&writer->diskinfo, 1, sizeof(writer->diskinfo),
+		writer->file) != sizeof(writer->diskinfo)) {
+		myabort("Error reading Disk-Info: File to short\n");
+	}
+	if (strncmp(writer->diskinfo.magic, extended ? MAGIC_EDISK : MAGIC_DISK,
+		strlen(extended ? MAGIC_EDISK : MAGIC_DISK)) ||
+		writer->diskinfo.heads != heads) {
+		myabort("Error resuming: Image of another format\n");
+	}
+	writer->extended = extended;
+	writer->heads = heads;
+	writer->tracklen = TRACKLEN;
+
+	/* drop whatever was written after the last complete track */
+	dskwriter_truncate(writer, ntracks, end);
+	return writer;
+}
+
+void dskwriter_truncate(Dskwriter *writer, int ntracks, long end) {
+
+	if (fflush(writer->file) != 0 ||
+		ftruncate(fileno(writer->file), end) != 0) {
+		perror("Error truncating image file");
+		exit(1);
+	}
+	writer->ntracks = ntracks;
+	writer->diskinfo.tracks = ntracks / writer->heads;
+	write_header(writer);
+}
+
+void dskwriter_close(Dskwriter *writer) {
+
+	writer->diskinfo.tracks = writer->ntracks / writer->heads;
+	write_header(writer);
+	if (fclose(writer->file) != 0) {
+		perror("Error writing image file");
+		exit(1);
+	}
+	free(writer);
+}
+
+int sector_size(int n) {
+	return 128 << (n > 6 ? 6 : n);
+}
+
+int dskimage_layout(Trackinfo *trackinfo, int extended, int *offset) {
+
+	int j, pos = 0;
+
+	for (j=0; j<trackinfo->spt; j++) {
+		if (offset) offset[j] = pos;
+		if (extended)
+			pos += sector_size(trackinfo->sectorinfo[j].bps);
+		else
+			pos += sector_size(trackinfo->bps);
+	}
+	return pos;
+}
+
+int dskimage_stored(Trackinfo *trackinfo, int extended, int *offset) {
+
+	Sectorinfo *sectorinfo;
+	int j, size, pos = 0;
+
+	if (!extended)
+		return dskimage_layout(trackinfo, extended, offset);
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (offset) offset[j] = pos;
+		size = sectorinfo->unused1 + sectorinfo->unused2*256;
+		pos += size ? size : sector_size(sectorinfo->bps);
+	}
+	return pos;
+}
+
+Dskimage *dskimage_open(char *filename) {
+
+	Dskimage *image;
+	Diskinfo *diskinfo;
+	Trackinfo *trackinfo;
+	struct stat st;
+	size_t pos, tracklen;
+	int i;
+
+	image = calloc(1, sizeof(*image));
+	if (image == NULL)
+		myabort("Error opening image file: Out of memory\n");
+
+	image->fd = open(filename, O_RDONLY);
+	if (image->fd < 0 || fstat(image->fd, &st) != 0) {
+		perror("Error opening image file");
+		exit(1);
+	}
+	image->size = st.st_size;
+	if (image->size < sizeof(Diskinfo)) {
+		myabort("Error reading Disk-Info: File to short\n");
+	}
+	image->map = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE,
+		image->fd, 0);
+	if (image->map == MAP_FAILED) {
+		perror("Error mapping image file");
+		exit(1);
+	}
+
+	/* read disk info, detect extended image */
+	diskinfo = image->diskinfo = (Diskinfo *) image->map;
+	if (strncmp(diskinfo->magic, MAGIC_DISK, strlen(MAGIC_DISK))) {
+		if (strncmp(diskinfo->magic, MAGIC_EDISK, strlen(MAGIC_EDISK))) {
+			myabort("Error reading Disk-Info: Invalid Disk-Info\n");
+		}
+		image->extended = TRUE;
+	}
+	image->tracks = diskinfo->tracks;
+	image->heads = diskinfo->heads;
+	if (image->heads < 1 || image->heads > MAX_SIDES ||
+		image->tracks * image->heads > sizeof(diskinfo->tracklenhigh)) {
+		myabort("Error reading Disk-Info: Invalid geometry\n");
+	}
+
+	/* index all tracks */
+	tracklen = diskinfo->tracklen[0] + diskinfo->tracklen[1]*256;
+	pos = sizeof(Diskinfo);
+	for (i=0; i<image->tracks * image->heads; i++) {
+		if (image->extended) tracklen = diskinfo->tracklenhigh[i]*256;
+		if (tracklen == 0)
+			continue;	/* unformatted track */
+		if (tracklen < sizeof(Trackinfo) || pos + tracklen > image->size) {
+			myabort("Error reading Track: File to short\n");
+		}
+		trackinfo = (Trackinfo *) (image->map + pos);
+		if (strncmp(trackinfo->magic, MAGIC_TRACK, strlen(MAGIC_TRACK)))
+			myabort("Error reading Track-Info: Invalid Track-Info\n");
+		if (trackinfo->spt > 29)
+			myabort("Error reading Track-Info: Too many sectors\n");
+		image->offset[i] = pos;
+		image->length[i] = tracklen - sizeof(Trackinfo);
+		pos += tracklen;
+	}
+	return image;
+}
+
+Trackinfo *dskimage_track(Dskimage *image, int track, int head,
+	unsigned char **data, int *len) {
+
+	int i = track * image->heads + head;
+
+	if (track >= image->tracks || head >= image->heads ||
+		image->offset[i] == 0) {
+		*data = NULL;
+		*len = 0;
+		return NULL;
+	}
+	*data = image->map + image->offset[i] + sizeof(Trackinfo);
+	*len = image->length[i];
+	return (Trackinfo *) (image->map + image->offset[i]);
+}
+
+void dskimage_sectors(Dskimage *image, Trackinfo *trackinfo,
+	unsigned char *data, int len, unsigned char **sect, int *size) {
+
+	Sectorinfo *sectorinfo;
+	int j, pos = 0;
+
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (image->extended) {
+			/* EDSK stores the real data length of each sector */
+			size[j] = sectorinfo->unused1 + sectorinfo->unused2*256;
+			if (size[j] == 0) size[j] = sector_size(sectorinfo->bps);
+		} else {
+			size[j] = sector_size(trackinfo->bps);
+		}
+		if (pos + size[j] > len)
+			size[j] = pos < len ? len - pos : 0;
+		sect[j] = data + pos;
+		pos += size[j];
+	}
+}
+
+void dskimage_close(Dskimage *image) {
+	munmap(image->map, image->size);
+	close(image->fd);
+	free(image);
+}
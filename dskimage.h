@@ -0,0 +1,128 @@
+/* $Id$
+ *
+ * dskimage.h - DSK and EDSK image files for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DSKIMAGE_H
+#define DSKIMAGE_H
+
+#include "common.h"
+
+void init_diskinfo( Diskinfo *diskinfo, int tracks, int heads, int tracklen );
+
+void timestamp_diskinfo( Diskinfo *diskinfo );
+
+/* Bytes of data of a sector with size code n */
+int sector_size(int n);
+
+/* Compute where the data of each sector of a track is stored. DSK images
+ * store all sectors with the size of the track, EDSK images store the
+ * sectors back to back with their own size. offset may be NULL. Returns
+ * the length of the track data.
+ */
+int dskimage_layout(Trackinfo *trackinfo, int extended, int *offset);
+
+/* As dskimage_layout() for a Track-Info read from an EDSK image, with the
+ * data length stored for each sector: weak sectors take all their copies.
+ */
+int dskimage_stored(Trackinfo *trackinfo, int extended, int *offset);
+
+/* Streaming image writer
+ *
+ * The Disk-Info block is reserved when the image is opened and every track
+ * is appended as soon as it has been read. The header always describes
+ * the complete cylinders written so far, so the image is usable even if
+ * reading is aborted half way. Only one track is held in memory.
+ *
+ * DSK images have a fixed track size, EDSK images store only the data of
+ * each track and the real size of each sector, unformatted tracks take no
+ * space at all.
+ */
+typedef struct dskwriter_t {
+	FILE *file;
+	Diskinfo diskinfo;
+	int extended;		/* write an EDSK image */
+	int heads;
+	int ntracks;		/* track blocks written so far */
+	int tracklen;		/* data bytes per track (DSK) */
+} Dskwriter;
+
+Dskwriter *dskwriter_open(char *filename, int heads, int extended);
+
+/* Append a track, len bytes of data as laid out by dskimage_layout() */
+void dskwriter_track(Dskwriter *writer, Trackinfo *trackinfo,
+	unsigned char *data, int len);
+
+/* Reopen an image written up to ntracks tracks ending at offset end to
+ * append further tracks, anything after end is cut off. The caller sets
+ * the track sizes of an EDSK header for the tracks kept.
+ */
+Dskwriter *dskwriter_resume(char *filename, int heads, int extended,
+	int ntracks, long end);
+
+/* Cut the image back to its first ntracks tracks, ending at offset end */
+void dskwriter_truncate(Dskwriter *writer, int ntracks, long end);
+
+/* Write a track again in place, at the Track-Info block at offset. The
+ * sectors must be laid out as when it was appended.
+ */
+void dskwriter_patch(Dskwriter *writer, long offset, Trackinfo *trackinfo,
+	unsigned char *data, int len);
+
+/* Flush everything written so far to the disk */
+void dskwriter_sync(Dskwriter *writer);
+
+/* Patch the header and close the image */
+void dskwriter_close(Dskwriter *writer);
+
+/* Memory mapped image reader
+ *
+ * The image is mapped read-only and an index of all Track-Info blocks is
+ * built from the track size table of the Disk-Info block (EDSK) or the
+ * common track size (DSK). Tracks can be accessed in any order, and sector
+ * data is handed out as pointers into the mapping without copying.
+ */
+typedef struct dskimage_t {
+	int fd;
+	unsigned char *map;
+	size_t size;
+	Diskinfo *diskinfo;
+	int extended;		/* EDSK image */
+	int tracks;
+	int heads;
+	size_t offset[0xCC];	/* Track-Info offset per track, 0 if unformatted */
+	size_t length[0xCC];	/* data bytes after the Track-Info */
+} Dskimage;
+
+Dskimage *dskimage_open(char *filename);
+
+/* Trackinfo of a track or NULL if it is unformatted. *data is set to the
+ * track data and *len to its length.
+ */
+Trackinfo *dskimage_track(Dskimage *image, int track, int head,
+	unsigned char **data, int *len);
+
+/* Locate the data of all sectors of a track. sect[j] and size[j] are set
+ * for each sector of trackinfo, sectors are clipped to the track data.
+ */
+void dskimage_sectors(Dskimage *image, Trackinfo *trackinfo,
+	unsigned char *data, int len, unsigned char **sect, int *size);
+
+void dskimage_close(Dskimage *image);
+
+#endif /* DSKIMAGE_H */
@@ -20,6 +20,13 @@
  */
 
 #include "common.h"
+#include "dskimage.h"
+#include "fdcread.h"
+#include "profile.h"
+#include "fdctrace.h"
+#include "stats.h"
+#include "checkpoint.h"
+#include "recover.h"
 
 #include <unistd.h>
 #include <getopt.h>
@@ -32,6 +39,11 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+
+/* read modes, see also fdcread.h */
+int flag_pipeline = FALSE;	// overlap FDC I/O with image writing
+int flag_batch = FALSE;		// read disk after disk, filename is a template
 
 void rotateleft_sectorids(Trackinfo *trackinfo, int pos) {
 
@@ -69,448 +81,446 @@ void rotate_sectorids(Trackinfo *trackinfo) {
 
 }
 
-void	seek(int fd, int drive, int track)
-{
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	unsigned char mask = 0xFF;
-
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_INTR;
-	raw_cmd.track = track;
-	raw_cmd.rate  = 0;
-	raw_cmd.length= 0;
-
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_SEEK & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = track;
+/* Account a track read in usec: it could have been read in one revolution,
+ * or as scheduled if that takes longer.
+ */
+void account_track(int fd, int track, int side, long usec, long expected) {
 
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	long rev = fdc_profile(fd)->rev_usec;
 
-	if (err<0)
-		printf("error");
+	stats_track(fd, track, side, usec, expected > rev ? expected : rev);
 }
 
-#define FD_READTRACK (2|0x040)
-#define READ_ID 0x04a
-#define READ_DATA 0x046
-#define NSECTS 9
-
-char buf[8*1024];
-int read_ids(int fd, Trackinfo *trackinfo, int head, int drive) {
-
-	int i, err;
-	struct floppy_raw_cmd cmds[32];
-	struct floppy_raw_cmd *cur_cmd;
-
-	unsigned char mask = 0xFF;
-
-	cur_cmd = cmds;
-
-	/* --  detect unformatted track -- */
-	/* attempt to read an id and compare the result information
-	against what we are expecting for a unformatted track */
-
-	/* initialise this cmd */
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= /*(128<<(trackinfo->bps))*/ 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-			
-	err = ioctl(fd, FDRAWCMD, cmds);
-
-	if ((cur_cmd->reply[0] & 0x0c0)==0x040) 
-	{
-		/* check for specific command response which indicates
-		a unformatted track */
-		if (
-			(cur_cmd->reply[1]==1) && /* ST1 */
-			(cur_cmd->reply[2]==0) && /* ST2 */
-			(cur_cmd->reply[4]==0) && /* H */
-			(cur_cmd->reply[5]==1) && /* R */
-			(cur_cmd->reply[6]==0) /* N */
-			)
-		{
-			return 0;
+/* Report the sector IDs of a track read and how long it took. Returns the
+ * number of sectors that could not be read.
+ */
+int print_track(int fd, Trackinfo *trackinfo, long usec, long expected) {
+
+	int j, bad = 0;
+	long rev;
+	Sectorinfo *sectorinfo;
+	Report report;
+	FILE *out = report_begin(&report);
+
+	printtrackinfo(out, trackinfo);
+	fprintf(out, "\n [");
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		fprintf(out, "%02X", sectorinfo->sector);
+		if (sectorinfo->err1 || sectorinfo->err2) {
+			fprintf(out, "!");
+			bad++;
 		}
+		fprintf(out, " ");
+	}
+	rev = fdc_profile(fd)->rev_usec;
+	fprintf(out, "] %.2f revs", (double) usec / rev);
+	if (expected > 0)
+		fprintf(out, " (%.2f expected)", (double) expected / rev);
+	fprintf(out, "\n");
+	report_end(&report, fd);
+	return bad;
+}
 
-/*		int i;
-		for (i=0; i<7; i++)
-		{
-			printf("%02x ",cur_cmd->reply[i]);
-		}
-		printf("\r\n");
-*/
-	}	
-
-
-	/* setup a list of 32 read id commands:
-	- if each read id command is done seperatly then
-		some id's will be skipped. (the time between reading a id and
-		the next using seperate reads is too long for small sectors of
-		256 bytes in size!
-		- I've only seen up to 32 sectors on copyprotections,
-		I don't think there are copyprotections that use more.
-		- don't use seek flag; this seems to cause id's to be missed.
-		
-	   problems:
-		- need to calculate number of sectors per track
-		- need to find the first sector id
-	*/
-	/* synchronises with 2nd sector id on track */
-
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_MORE;
-//	cur_cmd->flags |= FD_RAW_SPIN;
-
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= 6500;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 7;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-
-#if 0
-	/* synchronises with 2nd sector id on track */
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_MORE;
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= (128<<(trackinfo->bps));
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 1;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-#endif
-#if 0
-	/* synchronises with 1st sector id on track */
-	/* attempt to read a non-existant sector */
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_SPIN;
-	cur_cmd->flags |= FD_RAW_MORE;
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= (128<<(trackinfo->bps));
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READ & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 2;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-#endif
-
-	/* initialise the read id command list */
-	for (i=1; i<32; i++)
-	{
-		cur_cmd = &cmds[i];
-
-		/* initialise this cmd */
-		init_raw_cmd(cur_cmd);
-		cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
-		if (i!=(32-1))
-		{
-			cur_cmd->flags |= FD_RAW_MORE;
-		}
-		cur_cmd->track = trackinfo->track;
-		cur_cmd->rate  = 2;	/* SD */
-		cur_cmd->length= 0; /*(128<<(trackinfo->bps));*/
-		cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
-		cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	}		
-	
-	err = ioctl(fd, FDRAWCMD, cmds);
-
-		if (err < 0) {
-		  perror("Error reading id");
-		  exit(1);
+/* Pipelined reading
+ *
+ * The FDC thread reads tracks into a ring of slots and steps to the next
+ * cylinder as soon as the last sector of a track is in. The main thread
+ * checks the finished tracks and streams them to the image file
+ * meanwhile, so host work and head stepping overlap with disk I/O.
+ */
+#define PIPE_SLOTS 4
+
+typedef struct slot_t {
+	Trackinfo trackinfo;
+	unsigned char data[MAX_TRACKLEN];
+	long usec;
+	long expected;
+} Slot;
+
+typedef struct pipeline_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Slot slot[PIPE_SLOTS];
+	int produced;
+	int consumed;
+	int fd, drv, startside, nsides, first, ntracks;
+	long latency;
+} Pipeline;
+
+void *read_thread(void *arg) {
+
+	Pipeline *pipeline = arg;
+	Slot *slot;
+	int i, k, side;
+
+	for ( i=pipeline->first; i<pipeline->ntracks; i++ ) {
+		for (k=0; k<pipeline->nsides; k++) {
+			side = (pipeline->startside+k)%MAX_SIDES;
+
+			pthread_mutex_lock(&pipeline->lock);
+			while (pipeline->produced - pipeline->consumed == PIPE_SLOTS)
+				pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+			slot = &pipeline->slot[pipeline->produced % PIPE_SLOTS];
+			pthread_mutex_unlock(&pipeline->lock);
+
+			init_trackinfo( &slot->trackinfo, i, k );
+			memset(slot->data, 0, sizeof(slot->data));
+			if (k == 0 && i == pipeline->first)
+				seek(pipeline->fd, pipeline->drv, i);
+			slot->usec = read_track(pipeline->fd, &slot->trackinfo,
+				slot->data, i, side, pipeline->drv, pipeline->latency,
+				&slot->expected);
+			account_track(pipeline->fd, i, side, slot->usec,
+				slot->expected);
+
+			/* step on right away */
+			if (k == pipeline->nsides-1 && i+1 < pipeline->ntracks)
+				seek(pipeline->fd, pipeline->drv, i+1);
+
+			pthread_mutex_lock(&pipeline->lock);
+			pipeline->produced++;
+			pthread_cond_signal(&pipeline->cond);
+			pthread_mutex_unlock(&pipeline->lock);
 		}
-
-/*	cur_cmd = cmds;
-	for (i=0; i<7; i++)
-	{
-		printf("%02x\r\n",cur_cmd->reply[i]);
-	}
-*/	
-
-	trackinfo->spt = NSECTS;
-	for (i=1; i<NSECTS+1; i++)
-	{
-		cur_cmd = &cmds[i];
-		trackinfo->sectorinfo[i-1].track = cur_cmd->reply[3];
-		trackinfo->sectorinfo[i-1].head = cur_cmd->reply[4];
-		trackinfo->sectorinfo[i-1].sector = cur_cmd->reply[5];
-		trackinfo->sectorinfo[i-1].bps = cur_cmd->reply[6];
 	}
+	return NULL;
+}
 
-	
-
-//	rotate_sectorids( trackinfo );
+void read_pipelined(int fd, Checkpoint *ckp, int drv, int startside,
+	int nsides, int first, int ntracks, long latency) {
+
+	Pipeline *pipeline;
+	pthread_t thread;
+	Slot *slot;
+	int n;
+
+	pipeline = calloc(1, sizeof(*pipeline));
+	if (pipeline == NULL)
+		myabort("Error reading: Out of memory\n");
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+	pipeline->fd = fd;
+	pipeline->drv = drv;
+	pipeline->startside = startside;
+	pipeline->nsides = nsides;
+	pipeline->first = first;
+	pipeline->ntracks = ntracks;
+	pipeline->latency = latency;
+
+	if (pthread_create(&thread, NULL, read_thread, pipeline) != 0)
+		myabort("Error reading: Can't start FDC thread\n");
+
+	for (n=0; n<(ntracks-first)*nsides; n++) {
+		pthread_mutex_lock(&pipeline->lock);
+		while (pipeline->produced == n)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		slot = &pipeline->slot[n % PIPE_SLOTS];
+		pthread_mutex_unlock(&pipeline->lock);
+
+		print_track(fd, &slot->trackinfo, slot->usec, slot->expected);
+		checkpoint_track(ckp, &slot->trackinfo, slot->data,
+			dskimage_layout(&slot->trackinfo, flag_edsk, NULL));
+
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->consumed++;
+		pthread_cond_signal(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
 
-	/* need to calculate number of sectors differently */	
-	return NSECTS;
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->cond);
+	free(pipeline);
 }
 
-/* standard FD_READ causes problems and is slower! */
+/* Read the sectors that failed in an earlier run again and write them into
+ * the image in place.
+ */
+void read_failed(int fd, Checkpoint *ckp, int drv, int startside,
+	int nsides) {
+
+	Trackinfo trackinfo;
+	unsigned char data[MAX_TRACKLEN];
+	Sectorinfo *sectorinfo;
+	int offset[29];
+	int n, j, len, track, side, deleted;
+	long long start;
+
+	for (n=0; n<ckp->ntracks; n++) {
+		if (ckp->failed[n] == 0)
+			continue;
+		track = n / nsides;
+		side = (startside + n % nsides) % MAX_SIDES;
+		checkpoint_load(ckp, n, &trackinfo, data);
+		len = dskimage_stored(&trackinfo, flag_edsk, offset);
+		seek(fd, drv, track);
+		start = fdc_now(fd);
+		for (j=0; j<trackinfo.spt; j++) {
+			if (!(ckp->failed[n] & (1UL << j)))
+				continue;
+			sectorinfo = &trackinfo.sectorinfo[j];
+			deleted = sectorinfo->err2 & ST2_CM;
+			sectorinfo->err1 = 0;
+			sectorinfo->err2 = deleted;
+			read_sect(fd, &trackinfo, sectorinfo, data + offset[j],
+				track, side, drv);
+		}
+		print_track(fd, &trackinfo, fdc_now(fd) - start, 0);
+		checkpoint_patch(ckp, n, &trackinfo, data, len);
+	}
+}
 
-void read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
-	unsigned char *data, int track, int head, int drive) {
+/* Read the disk in the initialised drive into the image filename */
+void read_disk(int fd, char *filename, int drv, int startside, int nsides,
+	int ntracks, long latency) {
 
-	int i, err, retry=0, ok=0;
-	struct floppy_raw_cmd raw_cmd;
-	unsigned char mask = 0xFF;
+	Report report;
+	FILE *out;
+	Trackinfo trackinfo;
+	unsigned char data[MAX_TRACKLEN];
+	Checkpoint *ckp;
+	Recover_stats recovered;
+	int i, k, first, failed;
+	long usec, expected;
 
-//	reset(fd);
+	predict_init(fd);
 
-	do {
-		init_raw_cmd(&raw_cmd);
-		raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
-		raw_cmd.track = track;
-		raw_cmd.rate  = 2;	/* SD */
-		raw_cmd.length= (128<<(sectorinfo->bps));
-		raw_cmd.data  = data;
-		raw_cmd.cmd_count = 0;
-		raw_cmd.cmd[raw_cmd.cmd_count++] = READ_DATA & mask;
-		raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;	/* head */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */	
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
-	
-		err = ioctl(fd, FDRAWCMD, &raw_cmd);
-		if (err < 0) {
-			perror("Error reading");
-			exit(1);
-		}
+	printf("%s\n",filename);
 
-		if (((raw_cmd.reply[0] &0x0f8)==0x040) && (raw_cmd.reply[1]==0x080)) {
-			/* end of cylinder */
-			return;
-		}
+	/* open file, with flag_resume go on where an earlier run stopped */
+	ckp = checkpoint_open(filename, nsides, flag_edsk, flag_resume);
+	first = ckp->ntracks / nsides;
+	if (first > 0) {
+		printf("Resuming at track %d\n", first);
+		if (!flag_recover)
+			read_failed(fd, ckp, drv, startside, nsides);
+	}
 
-		if (raw_cmd.reply[0] & 0x40) {
-			recalibrate(fd,drive);
-			retry++;
-			fprintf(stderr,"TRY %d \n",retry);
+	/* with two sides the host work on one side overlaps the read of
+	   the other one */
+	if (flag_pipeline || nsides > 1) {
+		read_pipelined(fd, ckp, drv, startside, nsides, first, ntracks,
+			latency);
+	} else {
+		for ( i=first; i<ntracks; i++ ) {
+			seek(fd, drv,i);
+			for (k=0; k<nsides; k++) {
+				int side = (startside+k)%MAX_SIDES;
+
+				init_trackinfo( &trackinfo, i,k );
+				memset(data, 0, sizeof(data));
+
+				usec = read_track(fd, &trackinfo, data, i, side, drv,
+					latency, &expected);
+				account_track(fd, i, side, usec, expected);
+				print_track(fd, &trackinfo, usec, expected);
+				checkpoint_track(ckp, &trackinfo, data,
+					dskimage_layout(&trackinfo, flag_edsk, NULL));
+			}
 		}
-		else ok = 1; // Read ok, go to next
-	} while((retry<10) && (ok == 0));
-
-	if(!ok) {
-		printf("\n%02x %02x %02x\r\n",raw_cmd.reply[0],raw_cmd.reply[1], raw_cmd.reply[2]);
-		fprintf(stderr, "Could not read sector %0X\n",
-			sectorinfo->sector);
 	}
-}
-
-void init_trackinfo( Trackinfo *trackinfo, int track, int side ) {
 
-	int i;
+	if (flag_recover)
+		recover_disk(fd, ckp, drv, startside, nsides, &recovered);
+
+	out = report_begin(&report);
+	printdiskinfo(out, &ckp->writer->diskinfo);
+	seek_summary(out, fd);
+	retry_summary(out, fd);
+	if (flag_recover)
+		recover_summary(out, &recovered);
+	stats_summary(out, fd);
+	report_end(&report, fd);
+	failed = checkpoint_close(ckp);
+	if (failed)
+		fprintf(stderr, "%d sectors failed, --resume reads them again\n",
+			failed);
+}
 
-	memset(trackinfo, 0, sizeof(*trackinfo));
+/* Read a disk into the image filename. Returns the time it took in usec.
+ */
+long long readdsk(char *filename, int drv, int startside, int nsides, int 
+ntracks, char *sim) {
 
-	strncpy( trackinfo->magic, MAGIC_TRACK, sizeof( trackinfo->magic ) );
-	//unsigned char unused1[0x03];
-	trackinfo->track = track;
-	trackinfo->head = side;
-	//unsigned char unused2[0x02];
-	trackinfo->bps = 2;
-	trackinfo->spt = 0;
-	trackinfo->gap = 82;
-	trackinfo->fill = 0xFF;
-	//trackinfo->sectorinfo[29];
-//	for ( i=0; i<9; i++ ) {
-//		init_sectorinfo( &trackinfo->sectorinfo[i], track, 0, 0xC1+i );
-//	}
+	int fd;
+	long latency;
+	long long begin;
 
-}
+	/* open drive */
+	fd = fdc_open(drv, sim);
+	begin = fdc_now(fd);
 
-void init_diskinfo( Diskinfo *diskinfo, int tracks, int heads, int tracklen ) {
+	latency = profile_init(fd, drv);
 
-	memset(diskinfo, 0, sizeof(*diskinfo));
+	read_disk(fd, filename, drv, startside, nsides, ntracks, latency);
 
-	strncpy( diskinfo->magic, MAGIC_DISK_WRITE, sizeof( diskinfo->magic ) );
-	diskinfo->tracks = tracks;
-	diskinfo->heads = heads;
-	diskinfo->tracklen[0] = (char) tracklen;
-	diskinfo->tracklen[1] = (char) (tracklen >> 8);
-	//unsigned char tracklenhigh[0xCC];
+	begin = fdc_now(fd) - begin;
+	fdc_close(fd);
+	return begin;
 
 }
 
-void timestamp_diskinfo( Diskinfo *diskinfo ) {
+/* Batch mode
+ *
+ * The drive is initialised once, then disk after disk is read as they are
+ * fed in, into images named after a template. The disk change line tells
+ * when a disk has been taken out. While it is active the head is stepped
+ * every BATCH_POLL_USEC: the step pulse resets the line as soon as a new
+ * disk is in, and reading starts right away.
+ */
+#define BATCH_POLL_USEC 250000
 
-	time_t t;
-	struct tm *ltime;
+/* TRUE if the template has exactly one %d conversion, as in "disk%03d.dsk" */
+int batch_template(char *template) {
 
-	t = time(NULL);
-	ltime = localtime(&t);
-	/* FIXME: Can the formatting be messed up by locale settings? */
-	strftime( diskinfo->magic+14, 16, "%d %b %g %H:%M", ltime );
+	char *p = strchr(template, '%');
 
+	if (p == NULL)
+		return FALSE;
+	p += strspn(p + 1, "0123456789") + 1;
+	return *p == 'd' && strchr(p, '%') == NULL;
 }
 
-void readdsk(char *filename, int drv, int startside, int nsides, int 
-ntracks) {
-
-	/* Variable declarations */
-	int fd, tmp, err;
-	char drive[32];
-	struct floppy_raw_cmd raw_cmd;
-
-	Diskinfo diskinfo;
-	Trackinfo trackinfo[MAX_TRACKS*MAX_SIDES];
-	Sectorinfo *sectorinfo, **sectorinfos;
-	unsigned char data[TRACKLEN*TRACKS], *sect, *track;
-	int tracklen;
-	FILE *file;
-	int i, j, count;
-	char *magic_disk = MAGIC_DISK;
-	char *magic_edisk = MAGIC_EDISK;
-	char *magic_track = MAGIC_TRACK;
-	char flag_edisk = FALSE;	// indicates extended disk image format
-
-	/* initialization */
-	sprintf(drive,"/dev/fd%01d",drv);
-
-	/* open drive */
-	fd = open( drive, O_ACCMODE | O_NDELAY);
-	if ( fd < 0 ){
-		perror("Error opening floppy device");
-		exit(1);
-	}
+/* Returns 1 if the disk change line is active, 0 if not and -1 if the
+ * drive can't be polled.
+ */
+int disk_changed(int fd) {
 
-	printf("%s\n",filename);
+	struct floppy_drive_struct drvstat;
 
-	/* open file */
-	file = fopen(filename, "w");
-	if (file == NULL) {
-		perror("Error opening image file");
-		exit(1);
+	if (fdc_drvstat(fd, &drvstat) < 0) {
+		perror("Batch ended");
+		return -1;
 	}
+	return (drvstat.flags & FD_DISK_NEWCHANGE) ? 1 : 0;
+}
 
-	init( fd, drv);
-
-	sect = data;
-	for ( i=0; i<ntracks; i++ ) {
-		int k;
-		for (k=0; k<nsides; k++) {
-			int spt;
-			int side;
-			int ntrk;
-
-			ntrk = (i*nsides)+k;
-			side = (startside+k)%MAX_SIDES;
+/* Wait for a disk to be in the drive, returns FALSE if there is none */
+int wait_disk(int fd, int drv) {
 
-			init_trackinfo( &trackinfo[ntrk], i,k );
-			printtrackinfo(stderr, &trackinfo[ntrk]);
-			fprintf(stderr, "\n");
-			fprintf(stderr, " [");
+	int changed;
 
-			seek(fd, drv,i);
-			spt = read_ids(fd, &trackinfo[ntrk],side,drv);
-			/* Slow version: Read sectors in order */
-		
-			trackinfo->spt = spt;
-			for ( j=0; j<spt; j++ ) {
-				sectorinfo = &trackinfo[ntrk].sectorinfo[j];
-				fprintf(stderr, "%02X ", sectorinfo->sector);
-				read_sect(fd, &trackinfo[ntrk],sectorinfo,sect, i,side,drv);
-				sect += (128<<trackinfo[ntrk].bps);
-			}
-#if 0
-		trackinfo->spt = spt;
-		/* Fast version: Read sectors interleaved in two passes */
-		for ( j=0; j<spt; j+=2 ) {
-			sectorinfo = &trackinfo[i].sectorinfo[j];
-			fprintf(stderr, "%02X ", sectorinfo->sector);
-			read_sect(fd, &trackinfo[i], sectorinfo, sect,side,drv);
-			sect += 0x400;
-		}
-		sect = sect - ( 0x400 * j/2 ) + 0x200;
-		for ( j=1; j<spt; j+=2 ) {
-			sectorinfo = &trackinfo[i].sectorinfo[j];
-			fprintf(stderr, "%02X ", sectorinfo->sector);
-			read_sect(fd, &trackinfo[i], sectorinfo, sect,side,drv);
-			sect += 0x400;
-		}
-#endif
-			fprintf(stderr, "]\n");
-		}
+	while ((changed = disk_changed(fd)) > 0) {
+		seek(fd, drv, 1);
+		seek(fd, drv, 0);
+		changed = disk_changed(fd);
+		if (changed <= 0)
+			break;
+		fdc_sleep(fd, BATCH_POLL_USEC);
 	}
+	return changed == 0;
+}
 
-	init_diskinfo( &diskinfo, ntracks, nsides, TRACKLEN_INFO );
-	timestamp_diskinfo( &diskinfo );
-	printdiskinfo(stderr, &diskinfo);
+/* Wait for the disk to be taken out, returns FALSE if the drive can't be
+ * polled any more.
+ */
+int wait_removal(int fd) {
 
-	count = fwrite(&diskinfo, 1, sizeof(diskinfo), file);
-	if (count != sizeof(diskinfo)) {
-		myabort("Error writing Disk-Info: File to short\n");
-	}
+	int changed;
 
-	track = data;
-	tracklen = TRACKLEN;
-	for (i=0; i<diskinfo.tracks; i++) 
-	{
-		int j;
-		for (j=0; j<diskinfo.heads; j++)
-		{
-			int ninfo = (i*diskinfo.heads)+j;
-
-			count = fwrite(&trackinfo[ninfo], 1, 
-sizeof(trackinfo[ninfo]), file);
-			if (count != sizeof(trackinfo[ninfo])) 
-			{
-				myabort("Error writing Track-Info: File to short\n");
-			}
-			count = fwrite(track, 1, tracklen, file);
-			if (count != tracklen) 
-			{
-				myabort("Error writing Track: File to short\n");
-			}
-		}
-	
-		track += tracklen;
-	}
+	while ((changed = disk_changed(fd)) == 0)
+		fdc_sleep(fd, BATCH_POLL_USEC);
+	return changed > 0;
+}
 
-	fclose(file);
+/* Read disks until the drive can't be polled any more. Returns the time
+ * it took in usec, up to the end of the last disk read.
+ */
+long long readbatch(char *template, int drv, int startside, int nsides,
+	int ntracks, char *sim) {
+
+	int fd, n;
+	long latency;
+	long long begin, inserted, done;
+	char filename[1024];
+	Report report;
+	FILE *out;
+
+	fd = fdc_open(drv, sim);
+	begin = done = fdc_now(fd);
+
+	latency = profile_init(fd, drv);
+
+	for (n=1; wait_disk(fd, drv); n++) {
+		inserted = fdc_now(fd);
+		snprintf(filename, sizeof(filename), template, n);
+		read_disk(fd, filename, drv, startside, nsides, ntracks, latency);
+		done = fdc_now(fd);
+
+		out = report_begin(&report);
+		fprintf(out, "Disk %d read in %.2f s, %.1f disks per hour\n", n,
+			(done - inserted) / 1000000.0,
+			n * 3600000000.0 / (done - begin));
+		report_end(&report, fd);
+
+		if (!wait_removal(fd))
+			break;
+	}
+	fdc_close(fd);
+	return done - begin;
+}
 
+/* job mode, the other options apply to every job */
+int job_side = 0;
+int job_sides = 1;
+int job_tracks = 40;
+
+void read_job(Job *job) {
+	if (flag_batch)
+		job->usec = readbatch(job->image, job->drive, job_side, job_sides,
+			job_tracks, job->sim);
+	else
+		job->usec = readdsk(job->image, job->drive, job_side, job_sides,
+			job_tracks, job->sim);
 }
 
 void help_exit(int exitcode) {
 	fprintf(stderr, "usage: dskread [options] <filename>\n");
+	fprintf(stderr, "       dskread [options] -j <drive>:<filename>[:<sim image>] ...\n");
 	fprintf(stderr, "options: -d | --drive <drive>    select drive\n");
 	fprintf(stderr, "         -s | --side <side>      select side\n");
 	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
 	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -c | --chain            read whole tracks with one\n");
+	fprintf(stderr, "                                 chain of FDC commands\n");
+	fprintf(stderr, "         -i | --interleave       read sectors in the order that\n");
+	fprintf(stderr, "                                 needs the fewest revolutions\n");
+	fprintf(stderr, "         -p | --pipeline         write the image while reading\n");
+	fprintf(stderr, "                                 the next tracks (always on\n");
+	fprintf(stderr, "                                 with two sides)\n");
+	fprintf(stderr, "         -P | --predict          read tracks like the ones before\n");
+	fprintf(stderr, "                                 without scanning their IDs\n");
+	fprintf(stderr, "         -R | --raw              capture each track with one READ\n");
+	fprintf(stderr, "                                 TRACK and take the sectors apart\n");
+	fprintf(stderr, "                                 in software\n");
+	fprintf(stderr, "         -e | --edsk             write an extended DSK image\n");
+	fprintf(stderr, "         -b | --batch            read disk after disk as they are\n");
+	fprintf(stderr, "                                 changed, filename is a template\n");
+	fprintf(stderr, "                                 like disk%%03d.dsk\n");
+	fprintf(stderr, "         -k | --resume           go on with an interrupted read\n");
+	fprintf(stderr, "                                 and read failed sectors again\n");
+	fprintf(stderr, "         -r | --retries <reread>,<rotate>,<reseek>,<recal>\n");
+	fprintf(stderr, "                                 retries per escalation level\n");
+	fprintf(stderr, "                                 (default 2,2,2,2)\n");
+	fprintf(stderr, "         -w | --recover <passes> read without retries, then make\n");
+	fprintf(stderr, "                                 passes over the failed sectors\n");
+	fprintf(stderr, "                                 and merge their copies\n");
+	fprintf(stderr, "         -o | --probe            measure the drive and save its\n");
+	fprintf(stderr, "                                 profile for later runs\n");
+	fprintf(stderr, "         -j | --job <drive>:<filename>[:<sim image>]\n");
+	fprintf(stderr, "                                 read drive into filename, all\n");
+	fprintf(stderr, "                                 drives given read in parallel\n");
+	fprintf(stderr, "         -I | --sim <image>      read from a simulated drive\n");
+	fprintf(stderr, "                                 holding DSK image <image>\n");
+	fprintf(stderr, "         -T | --record <trace>   log all FDC commands and replies\n");
+	fprintf(stderr, "                                 to trace, %%d is the drive\n");
+	fprintf(stderr, "         -X | --replay <trace>   replay a recorded trace instead\n");
+	fprintf(stderr, "                                 of a drive\n");
+	fprintf(stderr, "         -J | --json <file>      write the run statistics to a\n");
+	fprintf(stderr, "                                 JSON file\n");
+	fprintf(stderr, "         -C | --chrome <file>    write a Chrome trace of all FDC\n");
+	fprintf(stderr, "                                 commands, tracks and retries\n");
 	fprintf(stderr, "         -h                      this help\n");
 	exit(exitcode);
 }
@@ -522,6 +532,23 @@ int main(int argc, char **argv) {
 		{"side", 1, 0, 's'},
 		{"sides", 1, 0, 'S'},
 		{"tracks", 1, 0, 't'},
+		{"chain", 0, 0, 'c'},
+		{"interleave", 0, 0, 'i'},
+		{"pipeline", 0, 0, 'p'},
+		{"predict", 0, 0, 'P'},
+		{"raw", 0, 0, 'R'},
+		{"edsk", 0, 0, 'e'},
+		{"batch", 0, 0, 'b'},
+		{"resume", 0, 0, 'k'},
+		{"retries", 1, 0, 'r'},
+		{"recover", 1, 0, 'w'},
+		{"sim", 1, 0, 'I'},
+		{"record", 1, 0, 'T'},
+		{"replay", 1, 0, 'X'},
+		{"json", 1, 0, 'J'},
+		{"chrome", 1, 0, 'C'},
+		{"job", 1, 0, 'j'},
+		{"probe", 0, 0, 'o'},
 		{"help", 0, 0, 'h'},
 		{0, 0, 0, 0}
 	};
@@ -530,15 +557,18 @@ int main(int argc, char **argv) {
 	char *side_string = NULL;
 	char *sides_string = NULL;
 	char *tracks_string = NULL;
+	char *sim = NULL;
 	int drive = 0;
 	char side = 0;
 	char sides = 1;
 	char tracks = 40;
+	Job jobs[MAX_JOBS];
+	int njobs = 0, i;
 
 	do {
 		int this_option_optind = optind ? optind : 1;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "d:s:S:t:h",
+		c = getopt_long(argc, argv, "d:s:S:t:cipPRebkr:w:I:j:T:X:J:C:oh",
 			long_options, &option_index);
 		switch(c) {
 			case 'h':
@@ -557,19 +587,102 @@ int main(int argc, char **argv) {
 			case 't':
 				tracks_string = optarg;
 				break;
+			case 'c':
+				flag_chain = TRUE;
+				break;
+			case 'i':
+				flag_interleave = TRUE;
+				break;
+			case 'P':
+				flag_predict = TRUE;
+				break;
+			case 'R':
+				flag_raw = TRUE;
+				break;
+			case 'e':
+				flag_edsk = TRUE;
+				break;
+			case 'b':
+				flag_batch = TRUE;
+				break;
+			case 'k':
+				flag_resume = TRUE;
+				break;
+			case 'o':
+				flag_probe = TRUE;
+				break;
+			case 'r':
+				if (!retry_policy(optarg))
+					help_exit(1);
+				break;
+			case 'w':
+				flag_recover = atoi(optarg);
+				if (flag_recover <= 0)
+					help_exit(1);
+				break;
+			case 'p':
+				flag_pipeline = TRUE;
+				break;
+			case 'I':
+				sim = optarg;
+				break;
+			case 'T':
+				flag_record = optarg;
+				break;
+			case 'X':
+				flag_replay = optarg;
+				break;
+			case 'J':
+				flag_json = optarg;
+				break;
+			case 'C':
+				flag_chrome = optarg;
+				break;
+			case 'j':
+				if (njobs == MAX_JOBS || !job_parse(&jobs[njobs++], optarg))
+					help_exit(1);
+				break;
 		}
 	} while (c != -1);
 
-	if (argc - optind != 1) {
-		help_exit(1);
-	}
-
 	if (drive_string != NULL) drive = atoi(drive_string);
 	if (side_string != NULL) side = atoi(side_string);
 	if (sides_string != NULL) sides = atoi(sides_string);
 	if (tracks_string != NULL) tracks = atoi(tracks_string);
 
-	readdsk( argv[optind], drive, side, sides, tracks );
+	if (flag_probe && njobs == 0 && argc - optind == 0) {
+		/* just probe the drive */
+		i = fdc_open(drive, sim);
+		profile_init(i, drive);
+		fdc_close(i);
+		return 0;
+	}
+	if (argc - optind != (njobs ? 0 : 1)) {
+		help_exit(1);
+	}
+	for (i=0; flag_batch && i<(njobs ? njobs : 1); i++) {
+		if (!batch_template(njobs ? jobs[i].image : argv[optind])) {
+			fprintf(stderr, "Batch mode needs a filename template with "
+				"one %%d\n");
+			help_exit(1);
+		}
+	}
+
+	if (njobs) {
+		job_side = side;
+		job_sides = sides;
+		job_tracks = tracks;
+		for (i=0; i<njobs; i++)
+			if (jobs[i].sim == NULL)
+				jobs[i].sim = sim;
+		jobs_run(jobs, njobs, read_job);
+		return 0;
+	}
+
+	if (flag_batch)
+		readbatch( argv[optind], drive, side, sides, tracks, sim );
+	else
+		readdsk( argv[optind], drive, side, sides, tracks, sim );
 
 	return 0;
 
@@ -20,6 +20,11 @@
  */
 
 #include "common.h"
+#include "dskimage.h"
+#include "fdcread.h"
+#include "profile.h"
+#include "fdctrace.h"
+#include "stats.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -31,21 +36,36 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 
-#define MAX_RETRY 20
+/* write modes, flag_chain in fdcread.h also selects whole track writes */
+int flag_update = FALSE;	// only rewrite tracks that differ from the image
+int flag_verify = FALSE;	// read tracks back after writing them
+
+#define VERIFY_PASSES 3
+
+typedef struct verify_stats_t {
+	int tracks;		/* tracks verified */
+	int rewritten;		/* sectors written again after verifying */
+	int failed;		/* sectors that never verified */
+} Verify_stats;
 
 /* notes:
  *
  * the C (track),H (head),R (sector id),N (sector size) parameters in the
  * sector id field do not need to be the same as the physical track and
  * physical side.
+ *
+ * side is the second byte of the FDC commands: head << 2 | unit of the
+ * drive on its controller. side & 3 passes for the drive where only its
+ * unit matters.
  */
 
-void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side) {
+void init_format_cmd(int fd, struct floppy_raw_cmd *raw_cmd, format_map_t *data,
+	int track, Trackinfo *trackinfo, unsigned char side) {
 
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	format_map_t data[20];		//FIXME
+	int i;
 	unsigned char mask = 0xFF;
 	Sectorinfo *sectorinfo;
 
@@ -60,34 +80,47 @@ void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side) {
 		sectorinfo++;
 	}
 	//fprintf(stderr, "Formatting Track %i\n", track);
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
-	raw_cmd.flags |= FD_RAW_NEED_SEEK;
-	raw_cmd.track = track;
-	raw_cmd.rate  = 2;	/* SD */
-	//raw_cmd.length= 512;	/* Sectorsize */
-	raw_cmd.length= (128<<(trackinfo->bps));
-	raw_cmd.data  = data;
-
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_FORMAT & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = side;	/* head: 4 or 0 */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 2;	/* sectorsize */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 9;	/* sectors */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 82;/* GAP */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 0;	/* filler */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->bps;	/* sectorsize */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->spt;	/* sectors */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GAP */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->fill;	/* filler */
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err < 0) {
-		perror("Error formatting");
+	init_raw_cmd(raw_cmd);
+	raw_cmd->flags = FD_RAW_WRITE | FD_RAW_INTR;
+	raw_cmd->flags |= FD_RAW_NEED_SEEK;
+	raw_cmd->track = track;
+	raw_cmd->rate  = fdc_profile(fd)->rate;
+	//raw_cmd->length= 512;	/* Sectorsize */
+	raw_cmd->length= trackinfo->spt * sizeof(format_map_t);
+	raw_cmd->data  = data;
+
+	raw_cmd->cmd[raw_cmd->cmd_count++] = FD_FORMAT & mask;
+	raw_cmd->cmd[raw_cmd->cmd_count++] = side;	/* head: 4 or 0 */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 2;	/* sectorsize */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 9;	/* sectors */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 82;/* GAP */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 0;	/* filler */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->bps;	/* sectorsize */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->spt;	/* sectors */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->gap;	/* GAP */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->fill;	/* filler */
+}
+
+void check_format(struct floppy_raw_cmd *raw_cmd, int track) {
+	if (raw_cmd->reply[0] & 0x40) {
+		fprintf(stderr, "Could not format track %i\n", track);
 		exit(1);
 	}
-	if (raw_cmd.reply[0] & 0x40) {
-		fprintf(stderr, "Could not format track %i\n", track);
+}
+
+void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side) {
+
+	int err;
+	struct floppy_raw_cmd raw_cmd;
+	format_map_t data[29];
+
+	init_format_cmd(fd, &raw_cmd, data, track, trackinfo, side);
+	err = fdc_rawcmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error formatting");
 		exit(1);
 	}
+	check_format(&raw_cmd, track);
 }
 
 /* notes:
@@ -96,180 +129,575 @@ void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side) {
  * will fail to write data to sector.
  */
 
-//void write_sect(int fd, int track, unsigned char sector, unsigned char *data) {
-void write_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
-	unsigned char *data, unsigned char side) {
+void init_write_cmd(int fd, struct floppy_raw_cmd *raw_cmd, Trackinfo *trackinfo,
+	Sectorinfo *sectorinfo, unsigned char *data, int track,
+	unsigned char side) {
 
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	//format_map_t data[9];
 	unsigned char mask = 0xFF;
 
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
-	raw_cmd.flags |= FD_RAW_NEED_SEEK;
+	init_raw_cmd(raw_cmd);
+	raw_cmd->flags = FD_RAW_WRITE | FD_RAW_INTR;
+	raw_cmd->flags |= FD_RAW_NEED_SEEK;
 
-	raw_cmd.track = sectorinfo->track;
-	raw_cmd.rate  = 2;	/* SD */
-	raw_cmd.length= (128<<(sectorinfo->bps)); /* Sectorsize */
-	raw_cmd.data  = data;
+	/* physical track, the ID may name any other */
+	raw_cmd->track = track;
+	raw_cmd->rate  = fdc_profile(fd)->rate;
+	raw_cmd->length= sector_size(sectorinfo->bps); /* Sectorsize */
+	raw_cmd->data  = data;
 
-	if (sectorinfo->unused1 & 0x040)
+	if (sectorinfo->err2 & ST2_CM)
 	{
 		/* "write deleted data" (totally untested!) */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE_DEL & mask;
+		raw_cmd->cmd[raw_cmd->cmd_count++] = FD_WRITE_DEL & mask;
 	}
 	else
 	{
 		/* "write data" */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE & mask;
+		raw_cmd->cmd[raw_cmd->cmd_count++] = FD_WRITE & mask;
 	}
 
 	// these parameters are same for "write data" and "write deleted data".
-	raw_cmd.cmd[raw_cmd.cmd_count++] = side;		/* head */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = side;		/* head */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->track;	/* track */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->head;	/* head */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->bps;	/* sectorsize */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->gap;	/* GPL */
+	/* DTL, the data length of 128 byte sectors */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->bps ? 0xFF : 0x80;
+}
+
+//void write_sect(int fd, int track, unsigned char sector, unsigned char *data) {
+void write_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int track, unsigned char side) {
+
+	int err;
+	struct floppy_raw_cmd raw_cmd;
+	Retry retry;
 
-	char ok=0, retry=0;
+	init_write_cmd(fd, &raw_cmd, trackinfo, sectorinfo, data, track, side);
 
+	char ok=0;
+
+	retry_init(&retry, fd);
 	do {
-		err = ioctl(fd, FDRAWCMD, &raw_cmd);
+		err = fdc_rawcmd(fd, &raw_cmd);
 		if (err < 0) {
 			perror("Error writing");
 			exit(1);
 		}
-		if (raw_cmd.reply[0] & 0x40) {
-			retry++;
-			if (retry>MAX_RETRY) ok=1;
-			recalibrate(fd, 0); //Force the head to move again
-		}
-		else ok=1;
+		if (!(raw_cmd.reply[0] & 0x40))
+			ok=1;
+		else if (!retry_next(&retry, fd, side & 3, track))
+			break;
 	} while (ok==0);
+	retry_end(&retry, fd, ok);
 
-	if (retry>MAX_RETRY)
+	if (!ok)
 		fprintf(stderr, "Could not write sector %0X\n",
 			sectorinfo->sector);
 }
 
-void writedsk(char *filename, unsigned char side) {
-
-	/* Variable declarations */
-	int fd, tmp, err;
-	char *drive;
-	struct floppy_raw_cmd raw_cmd;
-	//char buffer[ 512 * 2 * 24 ];
-	//char buffer[ 512 * 9 ];
-	char buffer[ 9 * sizeof(format_map_t) ];
-	format_map_t *data;
-
-	Diskinfo diskinfo;
-	Trackinfo trackinfo;
-	Sectorinfo *sectorinfo, **sectorinfos;
-	unsigned char track[MAX_TRACKLEN], *sect;
-	int tracklen;
-	FILE *in;
-	int i, j, count;
-	char *magic_disk = MAGIC_DISK;
-	char *magic_edisk = MAGIC_EDISK;
-	char *magic_track = MAGIC_TRACK;
-	char flag_edisk = FALSE;	// indicates extended disk image format
+/* Format a track and write all its sectors with one chain of commands.
+ * The sectors are written in the order they were formatted in, so each
+ * write finds its sector right behind the previous one instead of waiting
+ * a revolution. Sectors that fail in the chain are written again with
+ * write_sect().
+ */
+void write_track_chain(int fd, int track, Trackinfo *trackinfo,
+	unsigned char **sect, unsigned char side) {
 
-	/* initialization */
-	drive = "/dev/fd0";
+	int i, err;
+	struct floppy_raw_cmd cmds[30];
+	format_map_t data[29];
 
-	/* open drive */
-	fd = open( drive, O_ACCMODE | O_NDELAY);
-	if ( fd < 0 ){
-		perror("Error opening floppy device");
-		exit(1);
+	init_format_cmd(fd, &cmds[0], data, track, trackinfo, side);
+	cmds[0].flags |= FD_RAW_MORE | FD_RAW_SOFTFAILURE |
+		FD_RAW_STOP_IF_FAILURE;
+	for (i=0; i<trackinfo->spt; i++) {
+		init_write_cmd(fd, &cmds[i+1], trackinfo, &trackinfo->sectorinfo[i],
+			sect[i], track, side);
+		if (i != trackinfo->spt-1)
+			cmds[i+1].flags |= FD_RAW_MORE;
 	}
 
-	/* open file */
-	in = fopen(filename, "r");
-	if (in == NULL) {
-		perror("Error opening image file");
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error writing");
 		exit(1);
 	}
+	check_format(&cmds[0], track);
 
-	init( fd, 0 );
+	for (i=0; i<trackinfo->spt; i++) {
+		if (cmds[i+1].reply_count && !(cmds[i+1].reply[0] & 0x40))
+			continue;
+		write_sect(fd, trackinfo, &trackinfo->sectorinfo[i], sect[i],
+			track, side);
+	}
+}
 
-	/* read disk info, detect extended image */
-	count = fread(&diskinfo, 1, sizeof(diskinfo), in);
-	if (count != sizeof(diskinfo)) {
-		myabort("Error reading Disk-Info: File to short\n");
+/* A track is uniform if all its sectors are plain sectors of the track's
+ * size on the same cylinder and head: no deleted data, no errors and no
+ * short or weak sectors in the image.
+ */
+int uniform_track(Trackinfo *trackinfo, int *size) {
+
+	int j;
+	Sectorinfo *first = &trackinfo->sectorinfo[0], *sectorinfo;
+
+	if (trackinfo->spt == 0)
+		return FALSE;
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (sectorinfo->bps != trackinfo->bps ||
+			sectorinfo->track != first->track ||
+			sectorinfo->head != first->head ||
+			sectorinfo->err1 || sectorinfo->err2 ||
+			size[j] != sector_size(trackinfo->bps))
+			return FALSE;
 	}
-	if (strncmp(diskinfo.magic, magic_disk, strlen(magic_disk))) {
-		if (strncmp(diskinfo.magic, magic_edisk, strlen(magic_edisk))) {
-			myabort("Error reading Disk-Info: Invalid Disk-Info\n");
+	return TRUE;
+}
+
+/* The byte all sectors of a track are filled with, -1 if they hold data */
+int blank_track(Trackinfo *trackinfo, unsigned char **sect, int *size) {
+
+	int i, j, fill = sect[0][0];
+
+	for (j=0; j<trackinfo->spt; j++) {
+		for (i=0; i<size[j]; i++) {
+			if (sect[j][i] != fill)
+				return -1;
 		}
-		flag_edisk = TRUE;
 	}
-	printdiskinfo(stderr, &diskinfo);
+	return fill;
+}
 
-	/* Get tracklen for normal disk images */
-	tracklen = (diskinfo.tracklen[0] + diskinfo.tracklen[1]*256) - 0x100;
+/* Write a uniform track: a chain of the format and one multi-sector WRITE
+ * DATA for each run of sectors with consecutive IDs that are stored back
+ * to back in the image. On a standard track that is a single write right
+ * behind the format. If all sectors hold the same byte, they are formatted
+ * with it and not written at all. Sectors of failed runs are written again
+ * with write_sect().
+ */
+void write_track_uniform(int fd, int track, Trackinfo *trackinfo,
+	unsigned char **sect, int *size, unsigned char side) {
+
+	int i, j, err, fill, runs = 0;
+	int first[29];
+	struct floppy_raw_cmd cmds[30];
+	format_map_t data[29];
+	Trackinfo info;
+	Sectorinfo *sectorinfo;
 
-	/*fprintf(stderr, "writing Track: ");*/
-	for (i=0; i<diskinfo.tracks * diskinfo.heads; i++) {
-		/* read in track */
-		/*fprintf(stderr, "%2.2i ",i);
-		fflush(stderr);*/
-		if (flag_edisk) tracklen = diskinfo.tracklenhigh[i]*256 - 0x100;
-		if (tracklen > MAX_TRACKLEN) {
-			myabort("Error: Track to long.\n");
+	info = *trackinfo;
+	fill = blank_track(trackinfo, sect, size);
+	if (fill >= 0)
+		info.fill = fill;
+	init_format_cmd(fd, &cmds[0], data, track, &info, side);
+	cmds[0].flags |= FD_RAW_SOFTFAILURE | FD_RAW_STOP_IF_FAILURE;
+
+	for (j=0; fill < 0 && j<info.spt; j++) {
+		sectorinfo = &info.sectorinfo[j];
+		if (runs > 0 && sectorinfo->sector ==
+				cmds[runs].cmd[6] + 1 &&
+			sect[j] == sect[j-1] + size[j-1]) {
+			/* extend the run */
+			cmds[runs].cmd[6] = sectorinfo->sector;	/* EOT */
+			cmds[runs].length += size[j];
+			continue;
 		}
+		first[runs++] = j;
+		init_write_cmd(fd, &cmds[runs], &info, sectorinfo, sect[j],
+			track, side);
+		cmds[runs].cmd[0] &= ~0x80;	/* no multitrack */
+		cmds[runs-1].flags |= FD_RAW_MORE;
+	}
+
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error writing");
+		exit(1);
+	}
+	check_format(&cmds[0], track);
+
+	for (i=0; i<runs; i++) {
+		if (cmds[i+1].reply_count && !(cmds[i+1].reply[0] & 0x40))
+			continue;
+		for (j=first[i]; j<(i+1 < runs ? first[i+1] : info.spt); j++)
+			write_sect(fd, &info, &info.sectorinfo[j], sect[j],
+				track, side);
+	}
+}
 
-		/* read trackinfo */
-		memset(&trackinfo, 0, sizeof(trackinfo));
-		count = fread(&trackinfo, 1, sizeof(trackinfo), in);
-		if (count != sizeof(trackinfo)) {
-			myabort("Error reading Track-Info: File to short\n");
+/* Do the IDs of a scanned track match those of the image track? The scan
+ * doesn't start at the index, so the disk IDs may start anywhere in the
+ * sequence of the image.
+ */
+int same_ids(Trackinfo *disk, Trackinfo *trackinfo) {
+
+	int r, j;
+	Sectorinfo *got, *want;
+
+	if (disk->spt != trackinfo->spt)
+		return FALSE;
+	for (r=0; r<disk->spt; r++) {
+		for (j=0; j<trackinfo->spt; j++) {
+			got = &disk->sectorinfo[(r + j) % disk->spt];
+			want = &trackinfo->sectorinfo[j];
+			if (got->track != want->track || got->head != want->head ||
+				got->sector != want->sector || got->bps != want->bps)
+				break;
 		}
-		if (strncmp(trackinfo.magic, magic_track, strlen(magic_track)))
-			myabort("Error reading Track-Info: Invalid Track-Info\n");
+		if (j == trackinfo->spt)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Read a track back and compare it with the image. The IDs are scanned
+ * first, a track with other sectors, another order or another count than
+ * the image track differs. Only then the sectors are read with the IDs of
+ * the image in one chain and compared. Tracks with errors in the image
+ * never match. Returns TRUE if the track on disk already holds what the
+ * image does.
+ */
+int track_unchanged(int fd, int track, Trackinfo *trackinfo,
+	unsigned char **sect, int *size, unsigned char side, long latency) {
+
+	Trackinfo disk;
+	unsigned char data[MAX_TRACKLEN];
+	int offset[29];
+	int j, len;
+
+	for (j=0; j<trackinfo->spt; j++) {
+		if (trackinfo->sectorinfo[j].err1 ||
+			(trackinfo->sectorinfo[j].err2 & ~ST2_CM))
+			return FALSE;
+	}
+
+	seek(fd, side & 3, track);
+	scan_ids(fd, &disk, track, side >> 2, side & 3, latency);
+	if (!same_ids(&disk, trackinfo))
+		return FALSE;
+
+	disk = *trackinfo;
+	if (read_track_known(fd, &disk, 0, data, track, side >> 2, side & 3,
+		TRUE))
+		return FALSE;
+	dskimage_layout(&disk, flag_edsk, offset);
+
+	for (j=0; j<disk.spt; j++) {
+		len = size[j];
+		if (len > sector_size(disk.sectorinfo[j].bps))
+			len = sector_size(disk.sectorinfo[j].bps);
+		if (disk.sectorinfo[j].err2 != trackinfo->sectorinfo[j].err2 ||
+			memcmp(data + offset[j], sect[j], len))
+			return FALSE;
+	}
+	return TRUE;
+}
 
-		if (diskinfo.heads == 2) {
-			side = (trackinfo.head == 0) ? 0 : 4;
+/* Read a written track back and compare it with the image, sector by
+ * sector. The read is issued right behind the writes, so it starts with
+ * the first sector of the next revolution: a verify costs about one
+ * revolution, less than a second sweep over the disk would with its seeks.
+ * Sectors that don't match are written again and the track is verified
+ * once more, up to VERIFY_PASSES times. Sectors with errors in the image
+ * can't be written as such and are not verified.
+ */
+void verify_track(int fd, int track, Trackinfo *trackinfo,
+	unsigned char **sect, int *size, unsigned char side, Verify_stats *stats,
+	FILE *out) {
+
+	Trackinfo disk;
+	Sectorinfo *want, *got;
+	unsigned char data[MAX_TRACKLEN];
+	int offset[29];
+	int j, len, pass, bad;
+
+	stats->tracks++;
+	for (pass=0; pass<VERIFY_PASSES; pass++) {
+		disk = *trackinfo;
+		read_track_known(fd, &disk, 0, data, track, side >> 2, side & 3,
+			FALSE);
+		dskimage_layout(&disk, flag_edsk, offset);
+
+		bad = 0;
+		for (j=0; j<disk.spt; j++) {
+			want = &trackinfo->sectorinfo[j];
+			got = &disk.sectorinfo[j];
+			if (want->err1 || (want->err2 & ~ST2_CM))
+				continue;
+			len = size[j];
+			if (len > sector_size(got->bps))
+				len = sector_size(got->bps);
+			if (!got->err1 && got->err2 == want->err2 &&
+				!memcmp(data + offset[j], sect[j], len))
+				continue;
+
+			bad++;
+			fprintf(out, "Verify: track %d sector %02X %s\n", track,
+				want->sector, got->err1 ? "unreadable" : "differs");
+			if (pass == VERIFY_PASSES-1) {
+				stats->failed++;
+				continue;
+			}
+			write_sect(fd, trackinfo, want, sect[j], track, side);
+			stats->rewritten++;
 		}
-		printtrackinfo(stderr, &trackinfo);
-
-		/* read track */
-		count = fread(track, 1, tracklen, in);
-		if (count != tracklen)
-			myabort("Error reading Track: File to short\n");
-
-		/* format track */
-		format_track(fd, i/diskinfo.heads, &trackinfo, side);
-
-		/* write track */
-		sect = track;
-		sectorinfo = trackinfo.sectorinfo;
-		fprintf(stderr, " [");
-		for (j=0; j<trackinfo.spt; j++) {
-			fprintf(stderr, "%0X ", sectorinfo->sector);
-			write_sect(fd, &trackinfo, sectorinfo, sect, side);
-			sectorinfo++;
-			sect += (128<<trackinfo.bps);
+		if (bad == 0)
+			break;
+	}
+}
+
+/* Write the image filename to a disk, on side B if side is 4. Returns
+ * the time it took in usec.
+ */
+long long writedsk(char *filename, int drive, unsigned char side,
+	char *sim) {
+
+	/* Variable declarations */
+	int fd;
+	Dskimage *image;
+	Trackinfo *trackinfo;
+	unsigned char *track, *sect[29];
+	unsigned char (*bounce)[128<<6];
+	int size[29];
+	int tracklen;
+	int i, j, head;
+	int tracks = 0, written = 0;
+	Verify_stats stats;
+	Report report;
+	FILE *out;
+	long long begin, start;
+	long latency;
+
+	/* open drive */
+	fd = fdc_open(drive, sim);
+	begin = fdc_now(fd);
+	side |= FDC_UNIT(drive);
+
+	/* open file */
+	image = dskimage_open(filename);
+
+	bounce = malloc(29 * sizeof(*bounce));
+	if (bounce == NULL)
+		myabort("Error writing: Out of memory\n");
+	memset(&stats, 0, sizeof(stats));
+
+	latency = profile_init( fd, drive );
+
+	out = report_begin(&report);
+	printdiskinfo(out, image->diskinfo);
+	report_end(&report, fd);
+
+	/*fprintf(stderr, "writing Track: ");*/
+	for (i=0; i<image->tracks; i++) {
+		for (head=0; head<image->heads; head++) {
+			trackinfo = dskimage_track(image, i, head, &track, &tracklen);
+			if (trackinfo == NULL)
+				continue;	/* unformatted in the image */
+
+			if (image->heads == 2) {
+				side = ((trackinfo->head == 0) ? 0 : 4) | FDC_UNIT(drive);
+			}
+			out = report_begin(&report);
+			printtrackinfo(out, trackinfo);
+
+			/* write track, straight from the image */
+			dskimage_sectors(image, trackinfo, track, tracklen, sect, size);
+			fprintf(out, " [");
+			for (j=0; j<trackinfo->spt; j++) {
+				fprintf(out, "%0X ", trackinfo->sectorinfo[j].sector);
+				if (size[j] < sector_size(trackinfo->sectorinfo[j].bps)) {
+					/* short sector, don't write past the mapping */
+					memset(bounce[j], 0, sizeof(bounce[j]));
+					memcpy(bounce[j], sect[j], size[j]);
+					sect[j] = bounce[j];
+				}
+			}
+			fprintf(out, "]");
+
+			tracks++;
+			if (flag_update && track_unchanged(fd, i, trackinfo, sect,
+				size, side, latency)) {
+				fprintf(out, " unchanged\n");
+				report_end(&report, fd);
+				continue;
+			}
+			fprintf(out, "\n");
+			written++;
+			start = fdc_now(fd);
+
+			if (uniform_track(trackinfo, size)) {
+				write_track_uniform(fd, i, trackinfo, sect, size, side);
+			} else if (flag_chain) {
+				write_track_chain(fd, i, trackinfo, sect, side);
+			} else {
+				format_track(fd, i, trackinfo, side);
+				for (j=0; j<trackinfo->spt; j++)
+					write_sect(fd, trackinfo, &trackinfo->sectorinfo[j],
+						sect[j], i, side);
+			}
+			if (flag_verify)
+				verify_track(fd, i, trackinfo, sect, size, side, &stats,
+					out);
+			stats_track(fd, i, head, fdc_now(fd) - start, 0);
+			report_end(&report, fd);
 		}
-		fprintf(stderr, "]\n");
 	}
-	fprintf(stderr,"\n");
+	out = report_begin(&report);
+	fprintf(out,"\n");
+	if (flag_update)
+		fprintf(out, "%d of %d tracks rewritten\n", written, tracks);
+	if (flag_verify)
+		fprintf(out, "Verified %d tracks, %d sectors written again, "
+			"%d sectors failed\n", stats.tracks, stats.rewritten,
+			stats.failed);
+	seek_summary(out, fd);
+	retry_summary(out, fd);
+	stats_summary(out, fd);
+	report_end(&report, fd);
+
+	free(bounce);
+	dskimage_close(image);
+	begin = fdc_now(fd) - begin;
+	fdc_close(fd);
+	return begin;
+
+}
 
+/* job mode, side B of the images */
+unsigned char job_side = 0;
+
+void write_job(Job *job) {
+	job->usec = writedsk(job->image, job->drive, job_side, job->sim);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskwrite [options] [b] <filename>\n");
+	fprintf(stderr, "       dskwrite [options] [b] -j <drive>:<filename>[:<sim image>] ...\n");
+	fprintf(stderr, "options: -d | --drive <drive>    select drive\n");
+	fprintf(stderr, "         -c | --chain            format and write whole tracks\n");
+	fprintf(stderr, "                                 with one chain of FDC commands\n");
+	fprintf(stderr, "         -u | --update           read tracks back first and only\n");
+	fprintf(stderr, "                                 rewrite those that differ\n");
+	fprintf(stderr, "         -v | --verify           read tracks back after writing\n");
+	fprintf(stderr, "                                 and write bad sectors again\n");
+	fprintf(stderr, "         -o | --probe            measure the drive and save its\n");
+	fprintf(stderr, "                                 profile for later runs\n");
+	fprintf(stderr, "         -j | --job <drive>:<filename>[:<sim image>]\n");
+	fprintf(stderr, "                                 write filename to drive, all\n");
+	fprintf(stderr, "                                 drives given write in parallel\n");
+	fprintf(stderr, "         -I | --sim <image>      write to a simulated drive\n");
+	fprintf(stderr, "                                 holding DSK image <image>\n");
+	fprintf(stderr, "         -T | --record <trace>   log all FDC commands and replies\n");
+	fprintf(stderr, "                                 to trace, %%d is the drive\n");
+	fprintf(stderr, "         -X | --replay <trace>   replay a recorded trace instead\n");
+	fprintf(stderr, "                                 of a drive\n");
+	fprintf(stderr, "         -J | --json <file>      write the run statistics to a\n");
+	fprintf(stderr, "                                 JSON file\n");
+	fprintf(stderr, "         -C | --chrome <file>    write a Chrome trace of all FDC\n");
+	fprintf(stderr, "                                 commands, tracks and retries\n");
+	fprintf(stderr, "         -r | --retries <reread>,<rotate>,<reseek>,<recal>\n");
+	fprintf(stderr, "                                 retries per escalation level\n");
+	fprintf(stderr, "                                 (default 2,2,2,2)\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "b: write to side B\n");
+	exit(exitcode);
 }
 
 int main(int argc, char **argv) {
 
-	if (argc == 2) {
-		writedsk(argv[1],0);
-	} else if( (argc==3) && (strcmp(argv[1],"b")==0) ) {
-		writedsk(argv[2],4); //Write on side B
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"chain", 0, 0, 'c'},
+		{"update", 0, 0, 'u'},
+		{"verify", 0, 0, 'v'},
+		{"sim", 1, 0, 'I'},
+		{"record", 1, 0, 'T'},
+		{"replay", 1, 0, 'X'},
+		{"json", 1, 0, 'J'},
+		{"chrome", 1, 0, 'C'},
+		{"retries", 1, 0, 'r'},
+		{"job", 1, 0, 'j'},
+		{"probe", 0, 0, 'o'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	char *sim = NULL;
+	int drive = 0;
+	Job jobs[MAX_JOBS];
+	int njobs = 0, i;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:cuvI:r:j:T:X:J:C:oh",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				drive = atoi(optarg);
+				break;
+			case 'o':
+				flag_probe = TRUE;
+				break;
+			case 'c':
+				flag_chain = TRUE;
+				break;
+			case 'u':
+				flag_update = TRUE;
+				break;
+			case 'v':
+				flag_verify = TRUE;
+				break;
+			case 'I':
+				sim = optarg;
+				break;
+			case 'T':
+				flag_record = optarg;
+				break;
+			case 'X':
+				flag_replay = optarg;
+				break;
+			case 'J':
+				flag_json = optarg;
+				break;
+			case 'C':
+				flag_chrome = optarg;
+				break;
+			case 'r':
+				if (!retry_policy(optarg))
+					help_exit(1);
+				break;
+			case 'j':
+				if (njobs == MAX_JOBS || !job_parse(&jobs[njobs++], optarg))
+					help_exit(1);
+				break;
+		}
+	} while (c != -1);
+
+	if (njobs) {
+		if (argc - optind == 1 && strcmp(argv[optind],"b")==0)
+			job_side = 4;
+		else if (argc - optind != 0)
+			help_exit(1);
+		for (i=0; i<njobs; i++)
+			if (jobs[i].sim == NULL)
+				jobs[i].sim = sim;
+		jobs_run(jobs, njobs, write_job);
+	} else if (argc - optind == 1) {
+		writedsk(argv[optind],drive,0,sim);
+	} else if( (argc - optind == 2) && (strcmp(argv[optind],"b")==0) ) {
+		writedsk(argv[optind+1],drive,4,sim); //Write on side B
 	} else {
-		fprintf(stderr, "usage: dskwrite [b] <filename>\n");
+		help_exit(1);
 	}
 	return 0;
 
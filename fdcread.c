@@ -0,0 +1,1043 @@
+/* $Id$
+ *
+ * fdcread.c - Reading tracks through the FDC for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "fdcread.h"
+#include "dskimage.h"
+
+#include <math.h>
+
+/* read modes */
+int flag_chain = FALSE;		// read whole tracks with one command chain
+int flag_interleave = FALSE;	// read sectors in scheduled order
+int flag_predict = FALSE;	// skip the ID scan on tracks like the last ones
+int flag_raw = FALSE;		// capture whole tracks with READ TRACK
+int flag_recover = 0;		// passes over failed sectors after the disk
+
+/* sector layout */
+int flag_edsk = FALSE;		// lay out sectors as in an extended DSK image
+
+#define FD_READTRACK (2|0x040)
+#define READ_ID 0x04a
+#define READ_DATA 0x046
+#define SYNC_SECTS 7	/* sectors READ TRACK passes after the index */
+#define SHORT_IDS 11	/* READ IDs to try first, enough for 9 sectors */
+#define MAX_IDS 32	/* READ IDs at most, enough for 29 sectors */
+
+#define CHAIN_USEC 200	/* driver gap between chained commands */
+
+/* Rotational position of the sector IDs of a track as seen by read_ids() */
+typedef struct trackpos_t {
+	int first;		/* sectorinfo index of the first ID after the index */
+	int last;		/* sectorinfo index of the ID read last */
+	long long when;		/* fdc_now() just after it was read */
+	int offset[29];		/* byte offset of each ID from the index */
+} Trackpos;
+
+/* Sync with the index, then read nids IDs into cmds[1..nids] with one
+ * chain. Returns the usec the chain took.
+ */
+long chain_ids(int fd, struct floppy_raw_cmd *cmds, int nids, int track,
+	int head, int drive) {
+
+	int i, err;
+	struct floppy_raw_cmd *cur_cmd;
+	long long start;
+	char buf[8*1024];
+
+	unsigned char mask = 0xFF;
+
+	/* setup a list of read id commands:
+	- if each read id command is done seperatly then
+		some id's will be skipped. (the time between reading a id and
+		the next using seperate reads is too long for small sectors of
+		256 bytes in size!
+		- I've only seen up to 32 sectors on copyprotections,
+		I don't think there are copyprotections that use more.
+		- don't use seek flag; this seems to cause id's to be missed.
+		
+	   the IDs wrap after one revolution, read_ids() takes the
+	   number of sectors per track from that.
+	*/
+	/* synchronises with the index */
+
+	cur_cmd=cmds;
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+	cur_cmd->flags |= FD_RAW_MORE;
+//	cur_cmd->flags |= FD_RAW_SPIN;
+
+	cur_cmd->data = buf;
+	cur_cmd->track = track;
+	cur_cmd->rate  = fdc_profile(fd)->rate;
+	cur_cmd->length= 6500;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | FDC_UNIT(drive);
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = SYNC_SECTS;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
+
+
+	/* initialise the read id command list */
+	for (i=1; i<nids+1; i++)
+	{
+		cur_cmd = &cmds[i];
+
+		/* initialise this cmd */
+		init_raw_cmd(cur_cmd);
+		cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
+		if (i!=nids)
+		{
+			cur_cmd->flags |= FD_RAW_MORE;
+		}
+		cur_cmd->track = track;
+		cur_cmd->rate  = fdc_profile(fd)->rate;
+		cur_cmd->length= 0; /*(128<<(trackinfo->bps));*/
+		cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | FDC_UNIT(drive);
+	}
+
+	start = fdc_now(fd);
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error reading id");
+		exit(1);
+	}
+	return fdc_now(fd) - start;
+}
+
+/* Do two READ ID replies describe the same ID field? */
+int same_id(struct floppy_raw_cmd *a, struct floppy_raw_cmd *b) {
+	return (a->reply[0] & 0xc0) == (b->reply[0] & 0xc0) &&
+		!memcmp(&a->reply[3], &b->reply[3], 4);
+}
+
+/* Number of IDs after which the ID sequence in cmds[1..nids] repeats: the
+ * first ID is seen again and every ID after it matches the one a period
+ * before. At least two repeated IDs are required. Returns 0 if the IDs
+ * don't wrap.
+ */
+int id_period(struct floppy_raw_cmd *cmds, int nids) {
+
+	int p, i;
+
+	for (p=1; p<=nids-2; p++) {
+		for (i=1; i+p<=nids; i++) {
+			if (!same_id(&cmds[i], &cmds[i+p]))
+				break;
+		}
+		if (i+p > nids)
+			return p;
+	}
+	return 0;
+}
+
+/* The IDs of a track may repeat within one revolution, so the sectors per
+ * track are a multiple of the ID period. The chain started at the index
+ * and passed SYNC_SECTS + nids IDs, but it waited up to one revolution for
+ * the index, which gives a range of sector counts. Returns the multiple of
+ * period closest to the middle of that range, *sure is set if it is the
+ * only one in range.
+ */
+int count_sectors(int period, int nids, long usec, long latency, long rev,
+	int *sure) {
+
+	double revs, passed, lo, hi, mid;
+	int spt, best = 0, found = 0;
+
+	*sure = FALSE;
+	if (period == 0)
+		return 0;
+
+	revs = (double) (usec - latency) / rev;
+	passed = SYNC_SECTS + nids - 0.5;
+	lo = revs > 0 ? passed / revs * 0.85 : 0;
+	hi = revs > 1 ? passed / (revs - 1) * 1.15 : 1e9;
+	mid = revs > 0.5 ? passed / (revs - 0.5) : hi;
+
+	for (spt=period; spt<=29; spt+=period) {
+		if (spt >= lo && spt <= hi)
+			found++;
+		if (best == 0 || fabs(spt - mid) < fabs(best - mid))
+			best = spt;
+	}
+	*sure = found == 1 && best >= lo && best <= hi;
+	return best ? best : 29;
+}
+
+int read_ids(int fd, Trackinfo *trackinfo, Trackpos *pos, int head,
+	int drive, long latency) {
+
+	int i, nids, period, spt, sure;
+	long usec, rev = fdc_profile(fd)->rev_usec;
+	struct floppy_raw_cmd cmds[MAX_IDS+1];
+	struct floppy_raw_cmd *cur_cmd;
+
+	unsigned char mask = 0xFF;
+
+	cur_cmd = cmds;
+
+	/* --  detect unformatted track -- */
+	/* attempt to read an id and compare the result information
+	against what we are expecting for a unformatted track */
+
+	/* initialise this cmd */
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
+	cur_cmd->track = trackinfo->track;
+	cur_cmd->rate  = fdc_profile(fd)->rate;
+	cur_cmd->length= /*(128<<(trackinfo->bps))*/ 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | FDC_UNIT(drive);
+			
+	fdc_rawcmd(fd, cmds);
+
+	if ((cur_cmd->reply[0] & 0x0c0)==0x040) 
+	{
+		/* check for specific command response which indicates
+		a unformatted track */
+		if (
+			(cur_cmd->reply[1]==1) && /* ST1 */
+			(cur_cmd->reply[2]==0) && /* ST2 */
+			(cur_cmd->reply[4]==0) && /* H */
+			(cur_cmd->reply[5]==1) && /* R */
+			(cur_cmd->reply[6]==0) /* N */
+			)
+		{
+			return 0;
+		}
+
+/*		int i;
+		for (i=0; i<7; i++)
+		{
+			printf("%02x ",cur_cmd->reply[i]);
+		}
+		printf("\r\n");
+*/
+	}	
+
+
+	/* A short chain does for standard tracks, if the IDs don't wrap
+	   within it or the sector count is ambiguous read more IDs */
+	nids = SHORT_IDS;
+	usec = chain_ids(fd, cmds, nids, trackinfo->track, head, drive);
+	period = id_period(cmds, nids);
+	spt = count_sectors(period, nids, usec, latency, rev, &sure);
+	if (period == 0 || !sure) {
+		nids = MAX_IDS;
+		usec = chain_ids(fd, cmds, nids, trackinfo->track, head, drive);
+		period = id_period(cmds, nids);
+		if (period == 0) {
+			/* no repeated IDs, go by the time only */
+			spt = count_sectors(1, nids, usec, latency, rev, &sure);
+			fprintf(stderr, "Track %d: IDs don't repeat, assuming %d "
+				"sectors\n", trackinfo->track, spt);
+		} else {
+			spt = count_sectors(period, nids, usec, latency, rev, &sure);
+		}
+	}
+	pos->when = fdc_now(fd);
+
+	trackinfo->spt = spt;
+	for (i=1; i<spt+1; i++)
+	{
+		cur_cmd = &cmds[i];
+		trackinfo->sectorinfo[i-1].track = cur_cmd->reply[3];
+		trackinfo->sectorinfo[i-1].head = cur_cmd->reply[4];
+		trackinfo->sectorinfo[i-1].sector = cur_cmd->reply[5];
+		trackinfo->sectorinfo[i-1].bps = cur_cmd->reply[6];
+	}
+
+	/* READ TRACK started at the index and passed SYNC_SECTS sectors, so
+	   cmds[1] saw the ID after those. The IDs repeat every spt commands. */
+	pos->first = (spt - SYNC_SECTS % spt) % spt;
+	pos->last = (nids-1) % spt;
+
+//	rotate_sectorids( trackinfo );
+
+	return spt;
+}
+
+int scan_ids(int fd, Trackinfo *trackinfo, int track, int side, int drive,
+	long latency) {
+
+	Trackpos pos;
+
+	init_trackinfo(trackinfo, track, side);
+	trackinfo->spt = read_ids(fd, trackinfo, &pos, side, drive, latency);
+	return trackinfo->spt;
+}
+
+/* Estimate where the sector IDs are on the track, assuming it was
+ * formatted with the usual gaps (see fdcsim.c for the track layout).
+ */
+void layout_trackpos(Trackpos *pos, Trackinfo *trackinfo) {
+
+	int i, j, prev, used, gap;
+
+	used = 146;
+	for (j=0; j<trackinfo->spt; j++)
+		used += 62 + (128<<trackinfo->sectorinfo[j].bps);
+	gap = trackinfo->gap;
+	if (trackinfo->spt > 0 && used + gap*trackinfo->spt > TRACK_BYTES)
+		gap = (TRACK_BYTES - used) / trackinfo->spt;
+	if (gap < 1) gap = 1;
+
+	/* gap 4a, sync, index mark, gap 1, sync */
+	prev = pos->first;
+	pos->offset[prev] = 146 + 12;
+	for (i=1; i<trackinfo->spt; i++) {
+		j = (pos->first + i) % trackinfo->spt;
+		pos->offset[j] = pos->offset[prev] + 62 + gap +
+			(128<<trackinfo->sectorinfo[prev].bps);
+		prev = j;
+	}
+}
+
+/* Compute the order to read the sectors of a track in, so that it takes as
+ * few revolutions as possible. Each read starts first (or next, for all but
+ * the first) usec after the previous one ended: for separate ioctls that
+ * is the ioctl turnaround, in a chain it is the driver gap between two
+ * commands. The head position is extrapolated from the last ID read_ids()
+ * saw. Returns the expected duration in usec.
+ */
+long schedule_reads(Trackpos *pos, Trackinfo *trackinfo, long long now,
+	long first, long next, long rev, int *order) {
+
+	int i, j, best, done[29];
+	long angle, wait, bestwait, size;
+	long long total = 0;
+	double byte_usec = (double) rev / TRACK_BYTES;
+
+	if (trackinfo->spt == 0)
+		return 0;	/* unformatted track */
+	layout_trackpos(pos, trackinfo);
+	memset(done, 0, sizeof(done));
+
+	/* head position in bytes from the index when the first read starts */
+	angle = pos->offset[pos->last] + 10 +
+		(long) ((now - pos->when + first) / byte_usec);
+	total = first;
+
+	for (i=0; i<trackinfo->spt; i++) {
+		best = -1;
+		bestwait = 0;
+		for (j=0; j<trackinfo->spt; j++) {
+			if (done[j])
+				continue;
+			wait = ((pos->offset[j] - angle) % TRACK_BYTES + TRACK_BYTES)
+				% TRACK_BYTES;
+			if (best < 0 || wait < bestwait) {
+				best = j;
+				bestwait = wait;
+			}
+		}
+		done[best] = TRUE;
+		order[i] = best;
+
+		/* ID field, gap 2, data field */
+		size = 58 + (128<<trackinfo->sectorinfo[best].bps);
+		angle = pos->offset[best] + size;
+		total += (long) ((bestwait + size) * byte_usec);
+		if (i != trackinfo->spt-1) {
+			angle += (long) (next / byte_usec);
+			total += next;
+		}
+	}
+	return total;
+}
+
+/* standard FD_READ causes problems and is slower! */
+
+void init_read_cmd(int fd, struct floppy_raw_cmd *raw_cmd, Trackinfo *trackinfo,
+	Sectorinfo *sectorinfo, unsigned char *data, int track, int head,
+	int drive) {
+
+	unsigned char mask = 0xFF;
+
+	init_raw_cmd(raw_cmd);
+	raw_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+	raw_cmd->track = track;
+	raw_cmd->rate  = fdc_profile(fd)->rate;
+	raw_cmd->length= sector_size(sectorinfo->bps);
+	raw_cmd->data  = data;
+	raw_cmd->cmd_count = 0;
+	raw_cmd->cmd[raw_cmd->cmd_count++] = READ_DATA & mask;
+	raw_cmd->cmd[raw_cmd->cmd_count++] = (head<<2) | FDC_UNIT(drive);	/* head */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->track;	/* track */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->head;	/* head */	
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->bps;	/* sectorsize */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->gap;	/* GPL */
+	/* DTL, the data length of 128 byte sectors */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = sectorinfo->bps ? 0xFF : 0x80;
+}
+
+/* Did a read command succeed? End of cylinder counts as success. */
+int read_ok(struct floppy_raw_cmd *raw_cmd) {
+
+	if (raw_cmd->reply_count == 0)
+		return FALSE;	/* not executed */
+	if (((raw_cmd->reply[0] &0x0f8)==0x040) && (raw_cmd->reply[1]==0x080))
+		return TRUE;	/* end of cylinder */
+	return !(raw_cmd->reply[0] & 0x40);
+}
+
+int read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int track, int head, int drive) {
+
+	int err, ok=0;
+	struct floppy_raw_cmd raw_cmd;
+	Retry retry;
+
+//	reset(fd);
+
+	retry_init(&retry, fd);
+	do {
+		init_read_cmd(fd, &raw_cmd, trackinfo, sectorinfo, data,
+			track, head, drive);
+	
+		err = fdc_rawcmd(fd, &raw_cmd);
+		if (err < 0) {
+			perror("Error reading");
+			exit(1);
+		}
+
+		if (read_ok(&raw_cmd)) {
+			ok = 1; // Read ok, go to next
+		} else if (!flag_recover && retry_next(&retry, fd, drive, track)) {
+			fprintf(stderr,"TRY %d \n",retry.count);
+		} else {
+			break;
+		}
+	} while(ok == 0);
+	retry_end(&retry, fd, ok);
+
+	if (ok) {
+		/* keep deleted data, the only flag of a good sector */
+		sectorinfo->err1 = 0;
+		sectorinfo->err2 = raw_cmd.reply[2] & ST2_CM;
+	} else {
+		printf("\n%02x %02x %02x\r\n",raw_cmd.reply[0],raw_cmd.reply[1], raw_cmd.reply[2]);
+		fprintf(stderr, "Could not read sector %0X\n",
+			sectorinfo->sector);
+		/* keep the FDC status in the image */
+		sectorinfo->err1 = raw_cmd.reply[1];
+		sectorinfo->err2 = raw_cmd.reply[2];
+	}
+	return ok;
+}
+
+/* Read a whole track with one chain of READ DATA commands in the given
+ * sector order. Separate ioctls lose a revolution whenever the next sector
+ * has already passed the head, in a chain the driver issues the next
+ * command right away. Sectors that fail in the chain are read again with
+ * read_sect(). Returns the number of sectors that had to be retried.
+ *
+ * If the IDs are predicted, check is the number of READ IDs appended to
+ * the chain: they must return the IDs of order[0], order[1], ... once more,
+ * which shows that no other sector comes by in between. The chain stops at
+ * the first failure, and -1 is returned if it failed for a missing ID or
+ * sector or another ID came by, -2 if a bad sector stopped it before the
+ * IDs were checked.
+ */
+int read_track_chain(int fd, Trackinfo *trackinfo, int *order,
+	unsigned char *data, int *offset, int track, int head, int drive,
+	int check) {
+
+	int i, j, n, err, retried = 0;
+	struct floppy_raw_cmd cmds[2*29];
+	Sectorinfo *sectorinfo;
+
+	if (trackinfo->spt == 0)
+		return 0;
+
+	n = trackinfo->spt + check;
+	for (i=0; i<n; i++) {
+		if (i < trackinfo->spt) {
+			j = order[i];
+			init_read_cmd(fd, &cmds[i], trackinfo,
+				&trackinfo->sectorinfo[j], data + offset[j],
+				track, head, drive);
+		} else {
+			init_raw_cmd(&cmds[i]);
+			cmds[i].flags = FD_RAW_INTR;
+			cmds[i].track = track;
+			cmds[i].rate  = fdc_profile(fd)->rate;
+			cmds[i].cmd[cmds[i].cmd_count++] = READ_ID;
+			cmds[i].cmd[cmds[i].cmd_count++] =
+				(head<<2) | FDC_UNIT(drive);
+		}
+		if (i != n-1)
+			cmds[i].flags |= FD_RAW_MORE;
+		if (check)
+			cmds[i].flags |= FD_RAW_SOFTFAILURE | FD_RAW_STOP_IF_FAILURE;
+	}
+
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error reading");
+		exit(1);
+	}
+
+	if (check) {
+		for (i=0; i<trackinfo->spt && cmds[i].reply_count; i++) {
+			if (!read_ok(&cmds[i]) &&
+				(cmds[i].reply[1] & (ST1_MAM | ST1_ND)))
+				return -1;
+		}
+		if (cmds[n-1].reply_count == 0)
+			return -2;
+		for (i=trackinfo->spt; i<n; i++) {
+			sectorinfo = &trackinfo->sectorinfo[
+				order[(i - trackinfo->spt) % trackinfo->spt]];
+			if ((cmds[i].reply[0] & 0xc0) != 0 ||
+				cmds[i].reply[3] != sectorinfo->track ||
+				cmds[i].reply[4] != sectorinfo->head ||
+				cmds[i].reply[5] != sectorinfo->sector ||
+				cmds[i].reply[6] != sectorinfo->bps)
+				return -1;
+		}
+	}
+
+	for (i=0; i<trackinfo->spt; i++) {
+		j = order[i];
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (read_ok(&cmds[i])) {
+			sectorinfo->err1 = 0;
+			sectorinfo->err2 = cmds[i].reply[2] & ST2_CM;
+			continue;
+		}
+		read_sect(fd, trackinfo, sectorinfo,
+			data + offset[j], track, head, drive);
+		retried++;
+	}
+	return retried;
+}
+
+void init_trackinfo( Trackinfo *trackinfo, int track, int side ) {
+
+	memset(trackinfo, 0, sizeof(*trackinfo));
+
+	strncpy( trackinfo->magic, MAGIC_TRACK, sizeof( trackinfo->magic ) );
+	//unsigned char unused1[0x03];
+	trackinfo->track = track;
+	trackinfo->head = side;
+	//unsigned char unused2[0x02];
+	trackinfo->bps = 2;
+	trackinfo->spt = 0;
+	trackinfo->gap = 82;
+	trackinfo->fill = 0xFF;
+	//trackinfo->sectorinfo[29];
+//	for ( i=0; i<9; i++ ) {
+//		init_sectorinfo( &trackinfo->sectorinfo[i], track, 0, 0xC1+i );
+//	}
+
+}
+
+/* Predictive reading
+ *
+ * Most disks have the same layout on every track. Once PREDICT_TRACKS
+ * tracks in a row had the same sector IDs (apart from the cylinder) the
+ * next track is read right away with the IDs of the last one, in one
+ * chain. READ IDs at the end of the chain check the IDs up to the first
+ * one after the index, and only if a sector is not found or another ID
+ * comes by the IDs are scanned again.
+ */
+#define PREDICT_TRACKS 3
+
+typedef struct fingerprint_t {
+	Trackinfo trackinfo;	/* IDs of the last track scanned */
+	int first;		/* sectorinfo index of the first ID after the index */
+	int tracks;		/* tracks in a row with this layout */
+} Fingerprint;
+
+/* per FDC handle, so that several drives can read at once */
+Fingerprint fingerprint[MAX_FDC][MAX_SIDES];
+
+void predict_init(int fd) {
+	memset(fingerprint[fd], 0, sizeof(fingerprint[fd]));
+}
+
+/* Remember the layout of a scanned track */
+void learn_track(int fd, Trackinfo *trackinfo, Trackpos *pos, int track,
+	int side) {
+
+	Fingerprint *fp = &fingerprint[fd][side];
+	Trackinfo *last = &fp->trackinfo;
+	int j, same;
+
+	same = trackinfo->spt > 0 && trackinfo->spt == last->spt;
+	for (j=0; same && j<trackinfo->spt; j++) {
+		same = trackinfo->sectorinfo[j].track - track ==
+				last->sectorinfo[j].track - last->track &&
+			trackinfo->sectorinfo[j].head == last->sectorinfo[j].head &&
+			trackinfo->sectorinfo[j].sector ==
+				last->sectorinfo[j].sector &&
+			trackinfo->sectorinfo[j].bps == last->sectorinfo[j].bps;
+	}
+	fp->tracks = same ? fp->tracks + 1 : 1;
+	fp->trackinfo = *trackinfo;
+	fp->first = trackinfo->spt ? pos->first : 0;
+}
+
+/* Fill in the predicted IDs of a track, returns FALSE if there is no
+ * prediction.
+ */
+int predict_track(int fd, Trackinfo *trackinfo, int *first, int track,
+	int side) {
+
+	Fingerprint *fp = &fingerprint[fd][side];
+	int j;
+
+	if (fp->tracks < PREDICT_TRACKS)
+		return FALSE;
+	trackinfo->spt = fp->trackinfo.spt;
+	for (j=0; j<trackinfo->spt; j++) {
+		trackinfo->sectorinfo[j] = fp->trackinfo.sectorinfo[j];
+		trackinfo->sectorinfo[j].track += track - fp->trackinfo.track;
+	}
+	*first = fp->first;
+	return TRUE;
+}
+
+/* Set the track size and drop sectors that don't fit into the track
+ * buffer. offset is set as for dskimage_layout().
+ */
+void layout_track(Trackinfo *trackinfo, int *offset, int track) {
+
+	int j;
+
+	/* the track size is that of the largest sector, so that no sector
+	   overlaps the next one in a DSK image */
+	for ( j=0; j<trackinfo->spt; j++ ) {
+		if ( j == 0 || trackinfo->sectorinfo[j].bps > trackinfo->bps )
+			trackinfo->bps = trackinfo->sectorinfo[j].bps;
+	}
+	while (trackinfo->spt > 0 && dskimage_layout(trackinfo, flag_edsk,
+		offset) > MAX_TRACKLEN) {
+		fprintf(stderr, "Track %d too long, ignoring sector %02X\n",
+			track, trackinfo->sectorinfo[trackinfo->spt-1].sector);
+		trackinfo->spt--;
+	}
+}
+
+/* Raw track capture
+ *
+ * READ TRACK with a sector size larger than the track starts transferring
+ * at the data field of the first sector after the index and then simply
+ * goes on: gaps, sync bytes, address marks and CRCs all come through as
+ * the FDC decodes them. One command a little longer than a revolution thus
+ * holds every ID and data field of the track, which are picked out in
+ * software. The data of the first sector is at the start of the stream,
+ * its ID and data mark show up once more after a revolution.
+ *
+ * The FDC keeps the byte framing of the first data field, so a field
+ * written out of step with it later on (by WRITE DATA) is garbled in the
+ * stream. Sectors whose data field is missing or bad are read once more
+ * with one chain of READ DATA, and tracks in which no revolution can be
+ * found are read the usual way.
+ */
+#define RAW_BYTES (TRACK_BYTES + 320)	/* a revolution and some for speed */
+#define RAW_SPEED 188	/* bytes a revolution may differ from TRACK_BYTES */
+#define RAW_IDS 64	/* ID fields kept from one capture */
+#define GAP2_MAX 64	/* bytes from the end of an ID field to its data mark */
+#define WRAP_CHECK 64	/* bytes compared to find the start of the stream */
+
+typedef struct rawsect_t {
+	int idpos;		/* stream offset of the ID address mark */
+	int datapos;		/* stream offset of the data, -1 if no data mark */
+	int idcrc;		/* the ID CRC is good */
+} Rawsect;
+
+/* Read RAW_BYTES of the track with READ TRACK into raw, returns the number
+ * of bytes the FDC transferred.
+ */
+int capture_track(int fd, unsigned char *raw, int track, int head,
+	int drive) {
+
+	int err;
+	struct floppy_raw_cmd raw_cmd;
+
+	unsigned char mask = 0xFF;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
+	raw_cmd.data  = raw;
+	raw_cmd.track = track;
+	raw_cmd.rate  = fdc_profile(fd)->rate;
+	raw_cmd.length= RAW_BYTES;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_READTRACK & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | FDC_UNIT(drive);
+	raw_cmd.cmd[raw_cmd.cmd_count++] = track;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = head;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 1;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 6;	/* 8K, more than a track */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 1;	/* EOT, one "sector" */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0x02a;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0x0ff;
+
+	err = fdc_rawcmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error reading track");
+		exit(1);
+	}
+	/* the driver leaves the untransferred rest in length */
+	return RAW_BYTES - raw_cmd.length;
+}
+
+/* Stream offset of the next ID (id set) or data address mark between from
+ * and to, -1 if there is none. Data marks are FB or F8 for deleted data.
+ */
+int find_mark(unsigned char *raw, int from, int to, int id) {
+
+	int p;
+
+	for (p=from; p+4<=to; p++) {
+		if (raw[p] != 0xA1 || raw[p+1] != 0xA1 || raw[p+2] != 0xA1)
+			continue;
+		if (id ? raw[p+3] == 0xFE : (raw[p+3] == 0xFB || raw[p+3] == 0xF8))
+			return p;
+	}
+	return -1;
+}
+
+/* Byte pos of the track, pos may lie past the end of the stream if it
+ * was captured rev bytes earlier.
+ */
+unsigned char raw_byte(unsigned char *raw, int len, int rev, long pos) {
+
+	while (pos >= len)
+		pos -= rev;
+	return raw[pos];
+}
+
+/* Find the ID fields in a stream of len bytes and their data fields.
+ * Returns the number of IDs, sect[0] is the first one after the index.
+ * The track is rev bytes long. Returns -1 if the start of the stream, and
+ * with it the revolution, can't be found.
+ */
+int parse_track(unsigned char *raw, int len, Rawsect *sect, int *rev) {
+
+	int i, j, p, q, n, wrap, best, match, count, size;
+	Rawsect ids[RAW_IDS];
+
+	n = 0;
+	for (p = find_mark(raw, 0, len, TRUE); p >= 0 && p + 10 <= len &&
+		n < RAW_IDS; p = find_mark(raw, p + 4, len, TRUE)) {
+		ids[n].idpos = p;
+		ids[n].idcrc = crc16(0xFFFF, raw + p, 10) == 0;
+		q = find_mark(raw, p + 10, p + 10 + GAP2_MAX < len ?
+			p + 10 + GAP2_MAX : len, FALSE);
+		ids[n].datapos = q < 0 ? -1 : q + 4;
+		n++;
+	}
+
+	/* The first sector's data starts the stream, so where the stream
+	   repeats its start a revolution has passed. Pick the data field
+	   about one revolution in that matches it best. */
+	wrap = -1;
+	best = 0;
+	for (i=0; i<n; i++) {
+		p = ids[i].datapos;
+		if (p < 0 || p < TRACK_BYTES - RAW_SPEED || p > TRACK_BYTES + RAW_SPEED)
+			continue;
+		count = len - p < WRAP_CHECK ? len - p : WRAP_CHECK;
+		for (match=0, j=0; j<count; j++)
+			match += raw[p + j] == raw[j];
+		if (count >= 16 && match * 2 > count && match > best) {
+			wrap = i;
+			best = match;
+		}
+	}
+	if (wrap < 0)
+		return -1;
+	*rev = ids[wrap].datapos;
+
+	/* the first sector, then the rest of the first revolution */
+	sect[0] = ids[wrap];
+	sect[0].datapos = 0;
+	for (i=0; i<wrap; i++)
+		sect[i+1] = ids[i];
+	n = wrap + 1;
+
+	/* An A1 A1 A1 FE in the data of a sector is no ID, unless the ID
+	   is intact, overlapping sectors are real. */
+	for (i=0, j=0; i<n; i++) {
+		for (q=0; !sect[i].idcrc && q<n; q++) {
+			p = sect[q].datapos;
+			size = sector_size(raw[sect[q].idpos + 7]);
+			if (sect[q].idcrc && p >= 0 && sect[i].idpos > p &&
+				sect[i].idpos < p + size)
+				break;
+		}
+		if (sect[i].idcrc || q == n)
+			sect[j++] = sect[i];
+	}
+	return j;
+}
+
+/* Capture a track with READ TRACK and rebuild its sectors. Returns the
+ * usec it took, or -1 if the stream could not be parsed and the track has
+ * to be read sector by sector.
+ */
+long read_track_raw(int fd, Trackinfo *trackinfo, unsigned char *data,
+	int track, int side, int drive) {
+
+	int i, j, k, len, rev, spt, n, err;
+	int offset[29], redo[29];
+	unsigned char raw[RAW_BYTES], b;
+	unsigned short crc;
+	long long start;
+	Rawsect sect[RAW_IDS];
+	Sectorinfo *sectorinfo;
+	struct floppy_raw_cmd cmds[29];
+
+	start = fdc_now(fd);
+	len = capture_track(fd, raw, track, side, drive);
+	spt = parse_track(raw, len, sect, &rev);
+	if (spt < 0) {
+		/* nothing at all is left to the ID scan, it may be unformatted */
+		if (len > 0)
+			fprintf(stderr, "Track %d: no revolution in the READ "
+				"TRACK stream, reading sectors\n", track);
+		return -1;
+	}
+	if (spt > 29) {
+		fprintf(stderr, "Track %d: %d sectors, keeping 29\n", track, spt);
+		spt = 29;
+	}
+
+	trackinfo->spt = spt;
+	for (j=0; j<spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		sectorinfo->track = raw[sect[j].idpos + 4];
+		sectorinfo->head = raw[sect[j].idpos + 5];
+		sectorinfo->sector = raw[sect[j].idpos + 6];
+		sectorinfo->bps = raw[sect[j].idpos + 7];
+		sectorinfo->err1 = sectorinfo->err2 = 0;
+	}
+	/* gap 3 as formatted: from the data CRC to the next sync */
+	if (spt > 1 && sect[0].idcrc) {
+		k = sect[1].idpos - 12 -
+			(sector_size(trackinfo->sectorinfo[0].bps) + 2);
+		if (k > 0 && k < 256)
+			trackinfo->gap = k;
+	}
+	layout_track(trackinfo, offset, track);
+	spt = trackinfo->spt;
+
+	n = 0;
+	for (j=0; j<spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		if (!sect[j].idcrc)
+			sectorinfo->err1 = ST1_CRC;
+		if (sect[j].datapos < 0) {
+			sectorinfo->err1 |= ST1_MAM;
+			sectorinfo->err2 = ST2_MAM;
+			memset(data + offset[j], trackinfo->fill,
+				sector_size(sectorinfo->bps));
+		} else {
+			/* the mark of the first sector is that a revolution on */
+			k = j ? sect[j].datapos : rev;
+			crc = crc16(0xFFFF, raw + k - 4, 4);
+			if (raw[k - 1] == 0xF8)
+				sectorinfo->err2 = ST2_CM;
+			for (i=0; i<sector_size(sectorinfo->bps) + 2; i++) {
+				b = raw_byte(raw, len, rev, sect[j].datapos + i);
+				if (i < sector_size(sectorinfo->bps))
+					data[offset[j] + i] = b;
+				crc = crc16(crc, &b, 1);
+			}
+			if (crc != 0 && sect[j].idcrc) {
+				sectorinfo->err1 |= ST1_CRC;
+				sectorinfo->err2 |= ST2_CRC;
+			}
+		}
+		/* the FDC may still read a field that is garbled in the
+		   stream, unless it can't find it or finds another one */
+		if (sect[j].idcrc && (sectorinfo->err1 & (ST1_CRC | ST1_MAM))) {
+			for (k=0; k<spt; k++) {
+				if (k != j && trackinfo->sectorinfo[k].sector ==
+					sectorinfo->sector &&
+					trackinfo->sectorinfo[k].track ==
+					sectorinfo->track)
+					break;
+			}
+			if (k == spt)
+				redo[n++] = j;
+		}
+	}
+	if (n == 0)
+		return fdc_now(fd) - start;
+
+	for (i=0; i<n; i++) {
+		init_read_cmd(fd, &cmds[i], trackinfo,
+			&trackinfo->sectorinfo[redo[i]], data + offset[redo[i]],
+			track, side, drive);
+		if (i != n-1)
+			cmds[i].flags |= FD_RAW_MORE;
+	}
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error reading");
+		exit(1);
+	}
+	for (i=0; i<n; i++) {
+		sectorinfo = &trackinfo->sectorinfo[redo[i]];
+		if (cmds[i].reply_count == 0)
+			continue;
+		if (read_ok(&cmds[i])) {
+			sectorinfo->err1 = 0;
+			sectorinfo->err2 = cmds[i].reply[2] & ST2_CM;
+		} else if (!(cmds[i].reply[1] & (ST1_MAM | ST1_ND))) {
+			sectorinfo->err1 = cmds[i].reply[1];
+			sectorinfo->err2 = cmds[i].reply[2];
+		}
+	}
+	return fdc_now(fd) - start;
+}
+
+/* Read one track: sector IDs first, then the sectors in the selected read
+ * mode. The sector data is laid out for the image format written, see
+ * dskimage_layout(). Returns the usec the sector reads took, *expected is
+ * set to the scheduled time or 0.
+ */
+long read_track(int fd, Trackinfo *trackinfo, unsigned char *data,
+	int track, int side, int drive, long latency, long *expected) {
+
+	int j, spt, first, err;
+	Sectorinfo *sectorinfo;
+	Trackpos pos;
+	int order[29], offset[29];
+	long long start;
+	long usec;
+
+	*expected = 0;
+	if (flag_raw && (usec = read_track_raw(fd, trackinfo, data,
+		track, side, drive)) >= 0)
+		return usec;
+	if (flag_predict && predict_track(fd, trackinfo, &first, track, side)) {
+		layout_track(trackinfo, offset, track);
+		for (j=0; j<trackinfo->spt; j++)
+			order[j] = (first + j) % trackinfo->spt;
+		/* start at the index, a READ ID after the last sector has to
+		   see the first one again: a track with more sectors has the
+		   extra ones before the index */
+		start = fdc_now(fd);
+		err = read_track_chain(fd, trackinfo, order, data, offset,
+			track, side, drive, 1);
+		if (err >= 0)
+			return fdc_now(fd) - start;
+		if (err == -1) {
+			fprintf(stderr, "Track %d: layout changed, scanning IDs\n",
+				track);
+			fingerprint[fd][side].tracks = 0;
+		}
+		for (j=0; j<trackinfo->spt; j++)
+			trackinfo->sectorinfo[j].err1 =
+				trackinfo->sectorinfo[j].err2 = 0;
+	}
+
+	spt = read_ids(fd, trackinfo, &pos, side, drive, latency);
+	trackinfo->spt = spt;
+	if (flag_predict)
+		learn_track(fd, trackinfo, &pos, track, side);
+	layout_track(trackinfo, offset, track);
+	spt = trackinfo->spt;
+
+	start = fdc_now(fd);
+	if (flag_chain) {
+		/* Chained version: Read whole track at once */
+		*expected = schedule_reads(&pos, trackinfo, start,
+			latency, CHAIN_USEC, fdc_profile(fd)->rev_usec, order);
+		read_track_chain(fd, trackinfo, order, data, offset,
+			track, side, drive, FALSE);
+	} else if (flag_interleave) {
+		/* Fast version: Read sectors in the order that needs the
+		   fewest revolutions */
+		*expected = schedule_reads(&pos, trackinfo, start,
+			latency, latency, fdc_profile(fd)->rev_usec, order);
+		for ( j=0; j<spt; j++ ) {
+			sectorinfo = &trackinfo->sectorinfo[order[j]];
+			read_sect(fd, trackinfo, sectorinfo,
+				data + offset[order[j]],
+				track, side, drive);
+		}
+	} else {
+		/* Slow version: Read sectors in order */
+		for ( j=0; j<spt; j++ ) {
+			sectorinfo = &trackinfo->sectorinfo[j];
+			read_sect(fd, trackinfo, sectorinfo,
+				data + offset[j], track, side, drive);
+		}
+	}
+	return fdc_now(fd) - start;
+}
+
+int read_track_known(int fd, Trackinfo *trackinfo, int first,
+	unsigned char *data, int track, int side, int drive, int stop) {
+
+	int i, j, err, failed = 0;
+	Sectorinfo *sectorinfo;
+	int offset[29];
+	struct floppy_raw_cmd cmds[29];
+
+	layout_track(trackinfo, offset, track);
+	if (trackinfo->spt == 0)
+		return 0;
+
+	for (i=0; i<trackinfo->spt; i++) {
+		j = (first + i) % trackinfo->spt;
+		init_read_cmd(fd, &cmds[i], trackinfo, &trackinfo->sectorinfo[j],
+			data + offset[j], track, side, drive);
+		if (stop)
+			cmds[i].flags |= FD_RAW_SOFTFAILURE | FD_RAW_STOP_IF_FAILURE;
+		if (i != trackinfo->spt-1)
+			cmds[i].flags |= FD_RAW_MORE;
+	}
+
+	err = fdc_rawcmd(fd, cmds);
+	if (err < 0) {
+		perror("Error reading");
+		exit(1);
+	}
+
+	for (i=0; i<trackinfo->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[(first + i) % trackinfo->spt];
+		if (cmds[i].reply_count == 0) {
+			sectorinfo->err1 = ST1_ND;
+			sectorinfo->err2 = 0;
+			failed++;
+		} else if (read_ok(&cmds[i])) {
+			sectorinfo->err1 = 0;
+			sectorinfo->err2 = cmds[i].reply[2] & ST2_CM;
+		} else {
+			sectorinfo->err1 = cmds[i].reply[1];
+			sectorinfo->err2 = cmds[i].reply[2];
+			failed++;
+		}
+	}
+	return failed;
+}
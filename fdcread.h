@@ -0,0 +1,87 @@
+/* $Id$
+ *
+ * fdcread.h - Reading tracks through the FDC for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef FDCREAD_H
+#define FDCREAD_H
+
+#include "common.h"
+
+/* Track read engine, shared by dskread and dskwrite
+ *
+ * A track is read by scanning its sector IDs and then reading the sectors
+ * in the mode selected by the flags below. The data of each sector is laid
+ * out as in a DSK image, or an EDSK image if flag_edsk is set (see
+ * dskimage_layout()).
+ */
+extern int flag_chain;		/* read whole tracks with one command chain */
+extern int flag_interleave;	/* read sectors in scheduled order */
+extern int flag_predict;	/* skip the ID scan on tracks like the last ones */
+extern int flag_raw;		/* capture whole tracks with READ TRACK */
+extern int flag_recover;	/* passes over failed sectors, see recover.h */
+extern int flag_edsk;		/* lay out sectors as in an EDSK image */
+
+void init_trackinfo( Trackinfo *trackinfo, int track, int side );
+
+/* Forget the track layouts learned for flag_predict on fd, call it before
+ * reading a disk.
+ */
+void predict_init(int fd);
+
+/* Read one track into data, MAX_TRACKLEN bytes. The head has to be on the
+ * track already. Returns the usec the sector reads took, *expected is set
+ * to the scheduled time or 0.
+ */
+long read_track(int fd, Trackinfo *trackinfo, unsigned char *data,
+	int track, int side, int drive, long latency, long *expected);
+
+/* Scan the sector IDs of the track under the head into trackinfo, in the
+ * order they come by but not starting at the index. latency is the ioctl
+ * turnaround, see profile_init(). Returns the number of sectors, 0 if the
+ * track is unformatted.
+ */
+int scan_ids(int fd, Trackinfo *trackinfo, int track, int side, int drive,
+	long latency);
+
+/* Set up a READ DATA of sectorinfo into data */
+void init_read_cmd(int fd, struct floppy_raw_cmd *raw_cmd, Trackinfo *trackinfo,
+	Sectorinfo *sectorinfo, unsigned char *data, int track, int head,
+	int drive);
+
+/* Did a read command succeed? End of cylinder counts as success. */
+int read_ok(struct floppy_raw_cmd *raw_cmd);
+
+/* Read one sector into data with the retries of the retry policy, none
+ * if flag_recover is set. If it fails err1 and err2 of sectorinfo are set
+ * to ST1 and ST2. Returns FALSE then.
+ */
+int read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int track, int head, int drive);
+
+/* Read the sectors of a track whose IDs are known already, with one chain
+ * in the order of trackinfo starting with sector first. There are no
+ * retries, if stop is set the chain stops at the first failure. err1 and
+ * err2 of each sector are set to ST1 and ST2 of its read, sectors not
+ * read at all get ST1_ND. Returns the number of sectors that could not be
+ * read.
+ */
+int read_track_known(int fd, Trackinfo *trackinfo, int first,
+	unsigned char *data, int track, int side, int drive, int stop);
+
+#endif /* FDCREAD_H */
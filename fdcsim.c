@@ -0,0 +1,796 @@
+/* $Id$
+ *
+ * fdcsim.c - Simulated uPD765 floppy disc controller for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "fdcsim.h"
+#include "dskimage.h"
+
+#include <errno.h>
+
+/* notes:
+ *
+ * the simulated disk is a DSK/EDSK image. Every track is laid out the way
+ * FORMAT would have written it (gap 4a, sync, index mark, gap 1, then per
+ * sector sync, ID field, gap 2, sync, data field, gap 3), so sector IDs and
+ * data fields pass under the head at realistic times. The clock only
+ * advances while the simulated FDC waits for the disk, steps the head or
+ * the driver handles an ioctl.
+ *
+ * EDSK sector status bytes are honoured: ST1/ST2 data CRC errors, ID CRC
+ * errors (ST1 only), missing data address marks and deleted data. Sectors
+ * stored with several copies (weak sectors) return the next copy on each
+ * read.
+ */
+
+#define GAP4A_BYTES	146	/* gap 4a, sync, index mark, gap 1 */
+#define ID_BYTES	10	/* A1 A1 A1 FE C H R N CRC CRC */
+#define DATA_OFFSET	48	/* ID field, gap 2, sync, data mark */
+#define SECT_OVERHEAD	(12 + DATA_OFFSET + 2)
+
+typedef struct simsector_t {
+	unsigned char c, h, r, n;
+	unsigned char st1, st2;
+	int size;		/* bytes per copy */
+	int copies;		/* more than one for weak sectors */
+	int reads;
+	unsigned char *data;
+	int idpos;		/* byte offset of the ID address mark */
+	int datapos;		/* byte offset of the first data byte */
+} Simsector;
+
+typedef struct simtrack_t {
+	int nsect;
+	int gap;
+	int fill;
+	Simsector sect[SIM_MAX_SECTS];
+} Simtrack;
+
+typedef struct fdcsim_t {
+	char *images;		/* comma separated list of images */
+	char *image;
+	char *next;		/* images still to come, NULL after the last */
+	int present;		/* a disk is in the drive */
+	int changed;		/* disk change line */
+	int used;		/* the disk has been accessed */
+	long long insert;	/* clock when the next disk goes in */
+	int drive;
+	int tracks;
+	int heads;
+	int cyl;		/* head position */
+	long long clock;	/* usec since the first index pulse */
+	int dirty;
+	long ioctls;
+	long cmds;
+	Simtrack track[SIM_CYLS][MAX_SIDES];
+} Fdcsim;
+
+static int sect_size(int n) {
+	return 128 << (n > 6 ? 6 : n);
+}
+
+static int is_deleted(Simsector *s) {
+	return s->st2 & ST2_CM;
+}
+
+static int is_data_error(Simsector *s) {
+	return (s->st1 & ST1_CRC) && (s->st2 & ST2_CRC);
+}
+
+static int is_id_error(Simsector *s) {
+	return (s->st1 & ST1_CRC) && !(s->st2 & ST2_CRC);
+}
+
+static int is_reachable(Simsector *s) {
+	return s->idpos + ID_BYTES <= SIM_TRACK_BYTES;
+}
+
+static int is_overlong(Simsector *s) {
+	return s->datapos + sect_size(s->n) + 2 > SIM_TRACK_BYTES;
+}
+
+/* Position all ID and data fields on the track. The gap 3 is shrunk if the
+ * sectors would not fit otherwise, sectors past the end of the track can't
+ * be found, just like on a real overformatted track.
+ */
+static void layout_track(Simtrack *t) {
+
+	int i, pos, gap, need;
+	Simsector *s;
+
+	need = GAP4A_BYTES;
+	for (i=0; i<t->nsect; i++)
+		need += SECT_OVERHEAD + sect_size(t->sect[i].n);
+	gap = t->gap;
+	if (t->nsect > 0 && need + gap * t->nsect > SIM_TRACK_BYTES) {
+		gap = (SIM_TRACK_BYTES - need) / t->nsect;
+		if (gap < 1) gap = 1;
+	}
+
+	pos = GAP4A_BYTES;
+	for (i=0; i<t->nsect; i++) {
+		s = &t->sect[i];
+		s->idpos = pos + 12;
+		s->datapos = s->idpos + DATA_OFFSET;
+		pos = s->datapos + sect_size(s->n) + 2 + gap;
+	}
+}
+
+static void free_track(Simtrack *t) {
+
+	int i;
+
+	for (i=0; i<t->nsect; i++)
+		free(t->sect[i].data);
+	t->nsect = 0;
+}
+
+/* Data of the copy returned by the next read of a sector */
+static unsigned char *sector_copy(Simsector *s) {
+	return s->data + (s->reads++ % s->copies) * s->size;
+}
+
+/* Build the decoded MFM byte stream of a track as READ TRACK sees it */
+static void raw_track(Simtrack *t, unsigned char *raw) {
+
+	int i, j, pos;
+	unsigned short crc;
+	unsigned char id[8], *data;
+	Simsector *s;
+
+	memset(raw, 0x4E, SIM_TRACK_BYTES);
+	for (i=0; i<t->nsect; i++) {
+		s = &t->sect[i];
+		if (!is_reachable(s))
+			break;
+		memset(raw + s->idpos - 12, 0, 12);
+		id[0] = id[1] = id[2] = 0xA1;
+		id[3] = 0xFE;
+		id[4] = s->c; id[5] = s->h; id[6] = s->r; id[7] = s->n;
+		crc = crc16(0xFFFF, id, 8);
+		if (is_id_error(s)) crc = ~crc;
+		memcpy(raw + s->idpos, id, 8);
+		raw[s->idpos + 8] = crc >> 8;
+		raw[s->idpos + 9] = crc;
+		if (s->st2 & ST2_MAM)
+			continue;
+		pos = s->datapos - 16;
+		for (j=0; j<12; j++)
+			raw[(pos++) % SIM_TRACK_BYTES] = 0;
+		id[3] = is_deleted(s) ? 0xF8 : 0xFB;
+		for (j=0; j<4; j++)
+			raw[(pos++) % SIM_TRACK_BYTES] = id[j];
+		data = sector_copy(s);
+		crc = crc16(crc16(0xFFFF, id, 4), data, s->size);
+		if (is_data_error(s)) crc = ~crc;
+		for (j=0; j<sect_size(s->n); j++)
+			raw[(pos++) % SIM_TRACK_BYTES] =
+				j < s->size ? data[j] : t->fill;
+		raw[(pos++) % SIM_TRACK_BYTES] = crc >> 8;
+		raw[(pos++) % SIM_TRACK_BYTES] = crc;
+	}
+}
+
+/* usec until byte position pos of the track passes under the head */
+static long long until(Fdcsim *sim, int pos) {
+
+	long long angle = sim->clock % SIM_REV_USEC;
+
+	return ((long long) pos * SIM_BYTE_USEC - angle + SIM_REV_USEC)
+		% SIM_REV_USEC;
+}
+
+/* Wait for the next ID field to pass completely under the head. Returns
+ * the sector or NULL if no ID shows up before deadline.
+ */
+static Simsector *next_id(Fdcsim *sim, Simtrack *t, long long deadline) {
+
+	int i;
+	long long wait, best = -1;
+	Simsector *s = NULL;
+
+	for (i=0; i<t->nsect; i++) {
+		if (!is_reachable(&t->sect[i]))
+			continue;
+		wait = until(sim, t->sect[i].idpos);
+		if (best < 0 || wait < best) {
+			best = wait;
+			s = &t->sect[i];
+		}
+	}
+	if (s == NULL || sim->clock + best + ID_BYTES * SIM_BYTE_USEC > deadline) {
+		sim->clock = deadline;
+		return NULL;
+	}
+	sim->clock += best + ID_BYTES * SIM_BYTE_USEC;
+	return s;
+}
+
+/* Time of the second index pulse from now, after which the FDC gives up
+ * searching for a sector.
+ */
+static long long search_deadline(Fdcsim *sim) {
+	return sim->clock + until(sim, 0) + SIM_REV_USEC;
+}
+
+static void implied_seek(Fdcsim *sim, int track) {
+
+	int steps;
+
+	if (track >= SIM_CYLS) track = SIM_CYLS - 1;
+	steps = abs(track - sim->cyl);
+	if (steps == 0)
+		return;
+	if (sim->present)
+		sim->changed = FALSE;	/* the step pulse resets the line */
+	sim->clock += steps * SIM_STEP_USEC + SIM_SETTLE_USEC;
+	sim->cyl = track;
+}
+
+static void reply_chrn(struct floppy_raw_cmd *raw_cmd, int st0, int st1,
+	int st2, int c, int h, int r, int n) {
+
+	raw_cmd->reply[0] = st0;
+	raw_cmd->reply[1] = st1;
+	raw_cmd->reply[2] = st2;
+	raw_cmd->reply[3] = c;
+	raw_cmd->reply[4] = h;
+	raw_cmd->reply[5] = r;
+	raw_cmd->reply[6] = n;
+	raw_cmd->reply_count = 7;
+}
+
+static void sim_readid(Fdcsim *sim, struct floppy_raw_cmd *raw_cmd) {
+
+	int hd = (raw_cmd->cmd[1] >> 2) & 1;
+	int st0 = raw_cmd->cmd[1] & 7;
+	Simsector *s;
+
+	s = next_id(sim, &sim->track[sim->cyl][hd], search_deadline(sim));
+	if (s == NULL) {
+		/* unformatted track */
+		reply_chrn(raw_cmd, st0 | 0x40, ST1_MAM, 0, sim->cyl, 0, 1, 0);
+		return;
+	}
+	if (is_id_error(s))
+		reply_chrn(raw_cmd, st0 | 0x40, ST1_CRC, 0, s->c, s->h, s->r, s->n);
+	else
+		reply_chrn(raw_cmd, st0, 0, 0, s->c, s->h, s->r, s->n);
+}
+
+/* READ DATA, READ DELETED DATA, WRITE DATA and WRITE DELETED DATA */
+static void sim_rw(Fdcsim *sim, struct floppy_raw_cmd *raw_cmd, int op) {
+
+	int mt = raw_cmd->cmd[0] & 0x80;
+	int sk = raw_cmd->cmd[0] & 0x20;
+	int hd = (raw_cmd->cmd[1] >> 2) & 1;
+	int c = raw_cmd->cmd[2], h = raw_cmd->cmd[3], r = raw_cmd->cmd[4];
+	int n = raw_cmd->cmd[5], eot = raw_cmd->cmd[6], dtl = raw_cmd->cmd[8];
+	int xfer = n ? sect_size(n) : dtl;
+	int write = (op == 0x05 || op == 0x09);
+	int deleted = (op == 0x0C || op == 0x09);
+	int st1 = 0, st2 = 0, len, i;
+	long done = 0;
+	long long deadline;
+	unsigned char *buf = raw_cmd->data, *copy;
+	Simtrack *t;
+	Simsector *s;
+
+	for (;;) {
+		t = &sim->track[sim->cyl][hd];
+		deadline = search_deadline(sim);
+		do {
+			s = next_id(sim, t, deadline);
+		} while (s != NULL && (is_id_error(s) || s->c != c ||
+			s->h != h || s->r != r || s->n != n));
+		if (s == NULL) {
+			st1 = t->nsect ? ST1_ND : ST1_MAM;
+			goto abnormal;
+		}
+		if (s->st2 & ST2_MAM) {
+			st1 = ST1_MAM;
+			st2 = ST2_MAM;
+			goto abnormal;
+		}
+		sim->clock += (s->datapos - s->idpos - ID_BYTES + xfer + 2)
+			* SIM_BYTE_USEC;
+		len = xfer;
+		if (len > raw_cmd->length - done)
+			len = raw_cmd->length - done;
+
+		if (write) {
+			free(s->data);
+			s->data = malloc(xfer);
+			memset(s->data, 0, xfer);
+			memcpy(s->data, buf + done, len);
+			s->size = xfer;
+			s->copies = 1;
+			s->reads = 0;
+			s->st1 = 0;
+			s->st2 = deleted ? ST2_CM : 0;
+			sim->dirty = TRUE;
+			done += len;
+		} else {
+			if ((is_deleted(s) != 0) != deleted) {
+				if (sk)
+					goto next;
+				st2 |= ST2_CM;
+			}
+			copy = sector_copy(s);
+			for (i=0; i<len; i++)
+				buf[done + i] = i < s->size ? copy[i] : t->fill;
+			done += len;
+			if (is_data_error(s) || is_overlong(s)) {
+				st1 = ST1_CRC;
+				st2 |= ST2_CRC;
+				goto abnormal;
+			}
+			if (st2 & ST2_CM)
+				break;
+		}
+	next:
+		if (done >= raw_cmd->length)
+			break;
+		if (r == eot) {
+			if (mt && hd == 0) {
+				hd = 1;
+				h ^= 1;
+				r = 1;
+				continue;
+			}
+			st1 = ST1_EOC;
+			goto abnormal;
+		}
+		r++;
+	}
+	raw_cmd->length -= done;
+	reply_chrn(raw_cmd, (hd << 2) | (raw_cmd->cmd[1] & 3), 0, st2,
+		c, h, r, n);
+	return;
+
+abnormal:
+	raw_cmd->length -= done;
+	reply_chrn(raw_cmd, 0x40 | (hd << 2) | (raw_cmd->cmd[1] & 3), st1, st2,
+		c, h, r, n);
+}
+
+static void sim_readtrack(Fdcsim *sim, struct floppy_raw_cmd *raw_cmd) {
+
+	int hd = (raw_cmd->cmd[1] >> 2) & 1;
+	int st0 = raw_cmd->cmd[1] & 7;
+	int c = raw_cmd->cmd[2], h = raw_cmd->cmd[3], r = raw_cmd->cmd[4];
+	int n = raw_cmd->cmd[5], eot = raw_cmd->cmd[6], dtl = raw_cmd->cmd[8];
+	int xfer = n ? 128 << n : dtl;
+	int count = 0, st1 = 0, len, i;
+	long done = 0;
+	unsigned char *buf = raw_cmd->data;
+	unsigned char raw[SIM_TRACK_BYTES];
+	Simtrack *t = &sim->track[sim->cyl][hd];
+	Simsector *s;
+
+	/* READ TRACK starts at the index hole */
+	sim->clock += until(sim, 0);
+	raw_track(t, raw);
+	for (;;) {
+		s = next_id(sim, t, search_deadline(sim));
+		if (s == NULL) {
+			raw_cmd->length -= done;
+			reply_chrn(raw_cmd, st0 | 0x40, ST1_MAM, 0, c, h, r, n);
+			return;
+		}
+		if (s->c != c || s->h != h || s->r != r || s->n != n)
+			st1 |= ST1_ND;
+		len = xfer;
+		if (len > raw_cmd->length - done)
+			len = raw_cmd->length - done;
+		for (i=0; i<len; i++)
+			buf[done + i] = raw[(s->datapos + i) % SIM_TRACK_BYTES];
+		done += len;
+		/* the transfer ends early when the buffer is full */
+		sim->clock += (s->datapos - s->idpos - ID_BYTES + len +
+			(len == xfer ? 2 : 0)) * SIM_BYTE_USEC;
+		count++;
+		if (done >= raw_cmd->length)
+			break;
+		if (count >= eot) {
+			raw_cmd->length -= done;
+			reply_chrn(raw_cmd, st0 | 0x40, st1 | ST1_EOC, 0, c, h, r, n);
+			return;
+		}
+		r++;
+	}
+	raw_cmd->length -= done;
+	reply_chrn(raw_cmd, st0, st1, 0, c, h, r, n);
+}
+
+static void sim_format(Fdcsim *sim, struct floppy_raw_cmd *raw_cmd) {
+
+	int hd = (raw_cmd->cmd[1] >> 2) & 1;
+	int n = raw_cmd->cmd[2], sc = raw_cmd->cmd[3];
+	unsigned char *map = raw_cmd->data;
+	Simtrack *t = &sim->track[sim->cyl][hd];
+	Simsector *s;
+	int i;
+
+	/* FORMAT starts at the index hole and takes a whole revolution */
+	sim->clock += until(sim, 0) + SIM_REV_USEC;
+
+	free_track(t);
+	if (sc > SIM_MAX_SECTS) sc = SIM_MAX_SECTS;
+	t->nsect = sc;
+	t->gap = raw_cmd->cmd[4];
+	t->fill = raw_cmd->cmd[5];
+	for (i=0; i<sc; i++) {
+		s = &t->sect[i];
+		memset(s, 0, sizeof(*s));
+		s->c = map[i*4];
+		s->h = map[i*4+1];
+		s->r = map[i*4+2];
+		s->n = map[i*4+3];
+		s->size = sect_size(n);
+		s->copies = 1;
+		s->data = malloc(s->size);
+		memset(s->data, t->fill, s->size);
+	}
+	layout_track(t);
+	sim->dirty = TRUE;
+	if (sim->cyl >= sim->tracks) sim->tracks = sim->cyl + 1;
+	if (hd >= sim->heads) sim->heads = hd + 1;
+
+	if (sc > 0)
+		reply_chrn(raw_cmd, raw_cmd->cmd[1] & 7, 0, 0, map[(sc-1)*4],
+			map[(sc-1)*4+1], map[(sc-1)*4+2], n);
+	else
+		reply_chrn(raw_cmd, raw_cmd->cmd[1] & 7, 0, 0, 0, 0, 0, n);
+}
+
+static void sim_command(Fdcsim *sim, struct floppy_raw_cmd *raw_cmd) {
+
+	int op = raw_cmd->cmd[0] & 0x1F;
+	int steps;
+
+	sim->cmds++;
+	if (raw_cmd->flags & FD_RAW_NEED_SEEK)
+		implied_seek(sim, raw_cmd->track);
+
+	switch (op) {
+		case 0x0A:	/* READ ID */
+		case 0x06:	/* READ DATA */
+		case 0x0C:	/* READ DELETED DATA */
+		case 0x05:	/* WRITE DATA */
+		case 0x09:	/* WRITE DELETED DATA */
+		case 0x02:	/* READ TRACK */
+		case 0x0D:	/* FORMAT */
+			sim->used = TRUE;
+			break;
+	}
+
+	switch (op) {
+		case 0x0A:	/* READ ID */
+			sim_readid(sim, raw_cmd);
+			break;
+		case 0x06:	/* READ DATA */
+		case 0x0C:	/* READ DELETED DATA */
+		case 0x05:	/* WRITE DATA */
+		case 0x09:	/* WRITE DELETED DATA */
+			sim_rw(sim, raw_cmd, op);
+			break;
+		case 0x02:	/* READ TRACK */
+			sim_readtrack(sim, raw_cmd);
+			break;
+		case 0x0D:	/* FORMAT */
+			sim_format(sim, raw_cmd);
+			break;
+		case 0x0F:	/* SEEK, RELATIVE SEEK */
+			if (raw_cmd->cmd[0] & 0x80) {
+				steps = raw_cmd->cmd[2];
+				if (raw_cmd->cmd[0] & 0x40)
+					implied_seek(sim, sim->cyl + steps);
+				else
+					implied_seek(sim, sim->cyl > steps ?
+						sim->cyl - steps : 0);
+			} else {
+				implied_seek(sim, raw_cmd->cmd[2]);
+			}
+			raw_cmd->reply[0] = ST0_SE | (raw_cmd->cmd[1] & 7);
+			raw_cmd->reply[1] = sim->cyl;
+			raw_cmd->reply_count = 2;
+			break;
+		case 0x07:	/* RECALIBRATE */
+			steps = sim->cyl > SIM_RECAL_STEPS ? SIM_RECAL_STEPS : sim->cyl;
+			if (steps > 0)
+				sim->clock += steps * SIM_STEP_USEC + SIM_SETTLE_USEC;
+			sim->cyl -= steps;
+			if (steps > 0 && sim->present)
+				sim->changed = FALSE;
+			raw_cmd->reply[0] = ST0_SE | (raw_cmd->cmd[1] & 3);
+			if (sim->cyl != 0)
+				raw_cmd->reply[0] |= 0x40 | ST0_ECE;
+			raw_cmd->reply[1] = sim->cyl;
+			raw_cmd->reply_count = 2;
+			break;
+		case 0x04:	/* SENSE DRIVE STATUS */
+			raw_cmd->reply[0] = ST3_RY | ST3_DS | (raw_cmd->cmd[1] & 7);
+			if (sim->cyl == 0)
+				raw_cmd->reply[0] |= ST3_TZ;
+			raw_cmd->reply_count = 1;
+			break;
+		case 0x10:	/* VERSION */
+			raw_cmd->reply[0] = 0x90;	/* 82077, relative seeks */
+			raw_cmd->reply_count = 1;
+			break;
+		default:	/* invalid command */
+			raw_cmd->reply[0] = 0x80;
+			raw_cmd->reply_count = 1;
+			break;
+	}
+}
+
+/* Execute a chain of raw commands the way the floppy driver does */
+static int sim_rawcmd(void *priv, struct floppy_raw_cmd *raw_cmd) {
+
+	Fdcsim *sim = priv;
+	struct floppy_raw_cmd *cur_cmd = raw_cmd;
+	int failure;
+
+	sim->ioctls++;
+	sim->clock += SIM_IOCTL_USEC;
+	for (;;) {
+		cur_cmd->reply_count = 0;
+		memset(cur_cmd->reply, 0, sizeof(cur_cmd->reply));
+		cur_cmd->flags &= ~(FD_RAW_FAILURE | FD_RAW_HARDFAILURE);
+		sim_command(sim, cur_cmd);
+
+		failure = (cur_cmd->flags & FD_RAW_SOFTFAILURE) &&
+			(!cur_cmd->reply_count || (cur_cmd->reply[0] & 0xC0));
+		if (failure)
+			cur_cmd->flags |= FD_RAW_FAILURE;
+		if (!(cur_cmd->flags & FD_RAW_MORE))
+			break;
+		if ((failure && (cur_cmd->flags & FD_RAW_STOP_IF_FAILURE)) ||
+			(!failure && (cur_cmd->flags & FD_RAW_STOP_IF_SUCCESS))) {
+			/* rest of the chain is not executed */
+			while (cur_cmd->flags & FD_RAW_MORE) {
+				cur_cmd++;
+				cur_cmd->reply_count = 0;
+				memset(cur_cmd->reply, 0, sizeof(cur_cmd->reply));
+			}
+			break;
+		}
+		cur_cmd++;
+		sim->clock += SIM_CHAIN_USEC;
+	}
+	return 0;
+}
+
+static int sim_reset(void *priv) {
+	return 0;
+}
+
+static long long sim_now(void *priv) {
+	return ((Fdcsim *) priv)->clock;
+}
+
+static void sim_sleep(void *priv, long usec) {
+	((Fdcsim *) priv)->clock += usec;
+}
+
+static void load_image(Fdcsim *sim) {
+
+	Dskimage *image;
+	Trackinfo *trackinfo;
+	Sectorinfo *si;
+	Simtrack *t;
+	Simsector *s;
+	unsigned char *track, *sect[29];
+	int size[29];
+	int j, len, trk, side;
+
+	sim->tracks = 0;
+	sim->heads = 1;
+	if (access(sim->image, F_OK) != 0)
+		return;		/* unformatted disk */
+
+	image = dskimage_open(sim->image);
+	sim->heads = image->heads;
+	for (trk=0; trk<image->tracks && trk<SIM_CYLS; trk++) {
+		for (side=0; side<image->heads; side++) {
+			trackinfo = dskimage_track(image, trk, side, &track, &len);
+			if (trackinfo == NULL)
+				continue;	/* unformatted track */
+			dskimage_sectors(image, trackinfo, track, len, sect, size);
+
+			t = &sim->track[trk][side];
+			t->nsect = trackinfo->spt;
+			t->gap = trackinfo->gap;
+			t->fill = trackinfo->fill;
+			for (j=0; j<t->nsect; j++) {
+				si = &trackinfo->sectorinfo[j];
+				s = &t->sect[j];
+				s->c = si->track;
+				s->h = si->head;
+				s->r = si->sector;
+				s->n = si->bps;
+				s->st1 = si->err1;
+				s->st2 = si->err2;
+				s->size = size[j];
+				s->copies = 1;
+				if (size[j] > sect_size(s->n) &&
+					size[j] % sect_size(s->n) == 0) {
+					/* weak sector stored several times */
+					s->size = sect_size(s->n);
+					s->copies = size[j] / s->size;
+				}
+				s->data = malloc(size[j] > 0 ? size[j] : 1);
+				memcpy(s->data, sect[j], size[j]);
+			}
+			layout_track(t);
+			sim->tracks = trk + 1;
+		}
+	}
+	dskimage_close(image);
+}
+
+/* Save the simulated disk as EDSK image */
+static void save_image(Fdcsim *sim) {
+
+	Dskwriter *writer;
+	Trackinfo trackinfo;
+	Simtrack *t;
+	Simsector *s;
+	unsigned char *data;
+	int i, j, trk, side, len;
+	char *tmp;
+
+	tmp = malloc(strlen(sim->image) + 5);
+	sprintf(tmp, "%s.tmp", sim->image);
+	writer = dskwriter_open(tmp, sim->heads, TRUE);
+	for (i=0; i<sim->tracks * sim->heads; i++) {
+		trk = i / sim->heads;
+		side = i % sim->heads;
+		t = &sim->track[trk][side];
+		memset(&trackinfo, 0, sizeof(trackinfo));
+		trackinfo.track = trk;
+		trackinfo.head = side;
+		trackinfo.spt = t->nsect > 29 ? 29 : t->nsect;
+		trackinfo.bps = trackinfo.spt ? t->sect[0].n : 0;
+		trackinfo.gap = t->gap;
+		trackinfo.fill = t->fill;
+		len = 0;
+		for (j=0; j<trackinfo.spt; j++) {
+			s = &t->sect[j];
+			trackinfo.sectorinfo[j].track = s->c;
+			trackinfo.sectorinfo[j].head = s->h;
+			trackinfo.sectorinfo[j].sector = s->r;
+			trackinfo.sectorinfo[j].bps = s->n;
+			trackinfo.sectorinfo[j].err1 = s->st1;
+			trackinfo.sectorinfo[j].err2 = s->st2;
+			/* weak sectors are stored as several copies */
+			trackinfo.sectorinfo[j].unused1 = (s->size * s->copies) & 0xFF;
+			trackinfo.sectorinfo[j].unused2 = (s->size * s->copies) >> 8;
+			len += s->size * s->copies;
+		}
+		data = malloc(len + 1);
+		if (data == NULL)
+			myabort("Error saving simulated disk: Out of memory\n");
+		len = 0;
+		for (j=0; j<trackinfo.spt; j++) {
+			s = &t->sect[j];
+			memcpy(data + len, s->data, s->size * s->copies);
+			len += s->size * s->copies;
+		}
+		dskwriter_track(writer, &trackinfo, data, len);
+		free(data);
+	}
+	dskwriter_close(writer);
+	if (rename(tmp, sim->image) != 0) {
+		perror("Error saving simulated disk");
+		exit(1);
+	}
+	free(tmp);
+}
+
+/* Save the disk if it was written and take it out */
+static void eject(Fdcsim *sim) {
+
+	int i, j;
+
+	if (sim->dirty)
+		save_image(sim);
+	sim->dirty = FALSE;
+	for (i=0; i<SIM_CYLS; i++)
+		for (j=0; j<MAX_SIDES; j++)
+			free_track(&sim->track[i][j]);
+	sim->tracks = 0;
+	sim->present = FALSE;
+	sim->changed = TRUE;
+}
+
+/* Put the next disk of the list in */
+static void insert(Fdcsim *sim) {
+
+	char *comma = strchr(sim->next, ',');
+
+	if (comma != NULL)
+		*comma = 0;
+	sim->image = sim->next;
+	sim->next = comma ? comma + 1 : NULL;
+	load_image(sim);
+	sim->present = TRUE;
+	sim->used = FALSE;
+}
+
+static void sim_close(void *priv) {
+
+	Fdcsim *sim = priv;
+
+	fprintf(stderr, "fdcsim: %ld ioctls, %ld commands, %.3f s simulated "
+		"(%.1f revolutions)\n", sim->ioctls, sim->cmds,
+		sim->clock / 1000000.0, (double) sim->clock / SIM_REV_USEC);
+	if (sim->present)
+		eject(sim);
+	free(sim->images);
+	free(sim);
+}
+
+static int sim_drvstat(void *priv, struct floppy_drive_struct *drvstat) {
+
+	Fdcsim *sim = priv;
+
+	sim->ioctls++;
+	sim->clock += SIM_IOCTL_USEC;
+	if (sim->present && sim->used) {
+		eject(sim);
+		sim->insert = sim->clock + SIM_SWAP_USEC;
+	}
+	if (!sim->present) {
+		if (sim->next == NULL) {
+			errno = ENOMEDIUM;
+			return -1;
+		}
+		if (sim->clock >= sim->insert)
+			insert(sim);
+	}
+
+	memset(drvstat, 0, sizeof(*drvstat));
+	if (sim->changed)
+		drvstat->flags |= FD_DISK_NEWCHANGE | FD_DISK_CHANGED;
+	if (sim->present)
+		drvstat->flags |= FD_DISK_WRITABLE;
+	drvstat->track = sim->cyl;
+	return 0;
+}
+
+static Fdc_backend sim_backend = {
+	"sim", sim_rawcmd, sim_reset, sim_now, sim_sleep, sim_close,
+	sim_drvstat
+};
+
+int fdcsim_open(char *image, int drive) {
+
+	Fdcsim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		myabort("Error opening simulated drive: Out of memory\n");
+	sim->images = strdup(image);
+	sim->next = sim->images;
+	sim->drive = drive;
+	insert(sim);
+	return fdc_register(&sim_backend, sim, drive);
+}
@@ -0,0 +1,56 @@
+/* $Id$
+ *
+ * fdcsim.h - Simulated uPD765 floppy disc controller for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef FDCSIM_H
+#define FDCSIM_H
+
+#include "common.h"
+
+/* Timing of the simulated drive. The clock is virtual, so a simulated run
+ * takes as long as the host needs to execute it, but all reported times are
+ * those a real 300rpm double density drive would have taken.
+ */
+#define SIM_REV_USEC	200000	/* one revolution at 300 rpm */
+#define SIM_BYTE_USEC	32	/* one MFM byte at 250 kbit/s */
+#define SIM_TRACK_BYTES	(SIM_REV_USEC / SIM_BYTE_USEC)
+#define SIM_STEP_USEC	3000	/* head step time */
+#define SIM_SETTLE_USEC	15000	/* head settle time after stepping */
+#define SIM_IOCTL_USEC	4000	/* user <-> driver turnaround per ioctl */
+#define SIM_CHAIN_USEC	100	/* driver gap between chained commands */
+#define SIM_RECAL_STEPS	77	/* maximum steps of one recalibrate */
+#define SIM_SWAP_USEC	5000000	/* operator changing the disk */
+
+#define SIM_CYLS	(MAX_TRACKS + 2)
+#define SIM_MAX_SECTS	64
+
+/* Open a simulated drive with the DSK or EDSK image <image> inserted.
+ * If the image does not exist an unformatted disk is simulated. If the
+ * simulated disk is formatted or written the image is saved back on
+ * fdc_close(). Returns an FDC handle as fdc_open() does.
+ *
+ * <image> may be a comma separated list of images, which a simulated
+ * operator feeds one after another: once a disk has been read, written or
+ * formatted it is taken out at the next drive state poll and the next one
+ * goes in SIM_SWAP_USEC later. Polling after the last disk fails with
+ * ENOMEDIUM.
+ */
+int fdcsim_open(char *image, int drive);
+
+#endif /* FDCSIM_H */
@@ -0,0 +1,587 @@
+/* $Id$
+ *
+ * fdctrace.c - Recording and replaying FDC command streams for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "fdctrace.h"
+
+#include <errno.h>
+
+char *flag_record = NULL;	// record FDC handles into this trace
+char *flag_replay = NULL;	// replay this trace instead of a drive
+
+/* flags that tell commands apart, the rest is chaining or output */
+#define KEY_FLAGS (FD_RAW_READ | FD_RAW_WRITE | FD_RAW_INTR | \
+	FD_RAW_SPIN | FD_RAW_NEED_DISK | FD_RAW_NEED_SEEK)
+
+static void trace_name(char *name, int len, char *trace, int drive) {
+	snprintf(name, len, trace, drive);
+}
+
+/* Recorder */
+
+typedef struct recorder_t {
+	Fdc_backend backend;	/* record_backend named as the inner one */
+	Fdc_backend *inner;
+	void *priv;
+	int fd;
+	FILE *file;
+	long long last;		/* inner clock when the last event ended */
+} Recorder;
+
+static void put(FILE *file, unsigned long value, int bytes) {
+	while (bytes--) {
+		fputc(value & 0xFF, file);
+		value >>= 8;
+	}
+}
+
+/* Event header: type, gap since the last event, duration */
+static void put_event(Recorder *rec, int type, long long start,
+	long long end) {
+
+	long long gap = start - rec->last;
+
+	fputc(type, rec->file);
+	put(rec->file, gap < 0 ? 0 : gap > 0xFFFFFFFFLL ? 0xFFFFFFFF : gap, 4);
+	put(rec->file, end - start, 4);
+	rec->last = end;
+}
+
+static int record_rawcmd(void *priv, struct floppy_raw_cmd *raw_cmd) {
+
+	Recorder *rec = priv;
+	struct floppy_raw_cmd *cur_cmd;
+	long long start, end;
+	long *asked, len;
+	int i, n, ret, err;
+
+	for (n=1; raw_cmd[n-1].flags & FD_RAW_MORE; n++)
+		;
+	asked = malloc(n * sizeof(*asked));
+	if (asked == NULL)
+		myabort("Error recording: Out of memory\n");
+	for (i=0; i<n; i++)
+		asked[i] = raw_cmd[i].length;
+
+	start = rec->inner->now(rec->priv);
+	ret = rec->inner->rawcmd(rec->priv, raw_cmd);
+	err = errno;
+	end = rec->inner->now(rec->priv);
+
+	put_event(rec, 'C', start, end);
+	put(rec->file, ret, 4);
+	put(rec->file, err, 2);
+	put(rec->file, n, 1);
+	for (i=0; i<n; i++) {
+		cur_cmd = &raw_cmd[i];
+		put(rec->file, cur_cmd->flags, 4);
+		put(rec->file, cur_cmd->rate, 1);
+		put(rec->file, cur_cmd->track, 1);
+		put(rec->file, asked[i], 4);
+		put(rec->file, cur_cmd->length, 4);
+		put(rec->file, cur_cmd->cmd_count, 1);
+		fwrite(cur_cmd->cmd, 1, cur_cmd->cmd_count, rec->file);
+		put(rec->file, cur_cmd->reply_count, 1);
+		fwrite(cur_cmd->reply, 1, cur_cmd->reply_count, rec->file);
+		/* what the FDC transferred, reads only up to where it stopped */
+		len = 0;
+		if (cur_cmd->data && (cur_cmd->flags & FD_RAW_WRITE))
+			len = asked[i];
+		else if (cur_cmd->data && (cur_cmd->flags & FD_RAW_READ))
+			len = asked[i] - cur_cmd->length;
+		if (len < 0 || ret < 0)
+			len = 0;
+		put(rec->file, len, 4);
+		fwrite(cur_cmd->data, 1, len, rec->file);
+	}
+	free(asked);
+	errno = err;
+	return ret;
+}
+
+static int record_reset(void *priv) {
+
+	Recorder *rec = priv;
+	long long start;
+	int ret, err;
+
+	start = rec->inner->now(rec->priv);
+	ret = rec->inner->reset(rec->priv);
+	err = errno;
+	put_event(rec, 'R', start, rec->inner->now(rec->priv));
+	put(rec->file, ret, 4);
+	put(rec->file, err, 2);
+	errno = err;
+	return ret;
+}
+
+static long long record_now(void *priv) {
+
+	Recorder *rec = priv;
+
+	return rec->inner->now(rec->priv);
+}
+
+static void record_sleep(void *priv, long usec) {
+
+	Recorder *rec = priv;
+
+	rec->inner->sleep(rec->priv, usec);
+}
+
+static int record_drvstat(void *priv, struct floppy_drive_struct *drvstat) {
+
+	Recorder *rec = priv;
+	long long start;
+	int ret, err;
+
+	start = rec->inner->now(rec->priv);
+	ret = rec->inner->drvstat(rec->priv, drvstat);
+	err = errno;
+	put_event(rec, 'S', start, rec->inner->now(rec->priv));
+	put(rec->file, ret, 4);
+	put(rec->file, err, 2);
+	put(rec->file, drvstat->flags, 4);
+	put(rec->file, drvstat->track, 2);
+	errno = err;
+	return ret;
+}
+
+static void record_close(void *priv) {
+
+	Recorder *rec = priv;
+	Profile *profile = fdc_profile(rec->fd);
+	long long now = rec->inner->now(rec->priv);
+
+	/* the profile the run used, so that a replay uses it too */
+	put_event(rec, 'P', now, now);
+	put(rec->file, profile->probed ? 1 : 0, 1);
+	put(rec->file, profile->rate, 1);
+	put(rec->file, profile->rev_usec, 4);
+	put(rec->file, profile->step_usec, 4);
+	put(rec->file, profile->settle_usec, 4);
+	put(rec->file, profile->latency, 4);
+	if (fclose(rec->file) != 0)
+		perror("Error writing trace");
+	rec->inner->close(rec->priv);
+	free(rec);
+}
+
+static Fdc_backend record_backend = {
+	"record", record_rawcmd, record_reset, record_now, record_sleep,
+	record_close, record_drvstat
+};
+
+void fdctrace_record(int fd, char *trace, int drive) {
+
+	Recorder *rec;
+	char name[1024];
+
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL)
+		myabort("Error recording: Out of memory\n");
+	trace_name(name, sizeof(name), trace, drive);
+	rec->file = fopen(name, "wb");
+	if (rec->file == NULL) {
+		perror("Error opening trace");
+		exit(1);
+	}
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), rec->file);
+	put(rec->file, TRACE_VERSION, 1);
+	put(rec->file, drive, 1);
+
+	rec->fd = fd;
+	rec->backend = record_backend;
+	fdc_interpose(fd, &rec->backend, rec, &rec->inner, &rec->priv);
+	rec->last = rec->inner->now(rec->priv);
+	/* named as the recorded drive, so that it uses the same profile */
+	rec->backend.name = rec->inner->name;
+}
+
+/* Replay */
+
+typedef struct tracecmd_t {
+	unsigned int flags;
+	unsigned char rate, track;
+	long asked, left;
+	unsigned char cmd_count, cmd[FD_RAW_CMD_SIZE];
+	unsigned char reply_count, reply[FD_RAW_REPLY_SIZE];
+	long len;
+	unsigned char *data;	/* points into the trace */
+	int chain;
+	int used;
+} Tracecmd;
+
+typedef struct tracechain_t {
+	int first, n;		/* commands */
+	long usec;
+	int ret, err;
+} Tracechain;
+
+typedef struct traceevent_t {
+	long usec;
+	int ret, err;
+	unsigned long flags;
+	int track;
+} Traceevent;
+
+typedef struct replay_t {
+	unsigned char *trace;
+	Tracecmd *cmds;
+	Tracechain *chains;
+	Traceevent *resets, *stats;
+	int ncmds, nchains, nresets, nstats;
+	int chain, reset, stat;	/* next ones in order */
+	long long clock;
+	long exact, looked_up;
+} Replay;
+
+static unsigned long get(unsigned char **p, unsigned char *end, int bytes) {
+
+	unsigned long value = 0;
+	int i;
+
+	if (*p + bytes > end)
+		myabort("Error reading trace: Truncated\n");
+	for (i=0; i<bytes; i++)
+		value |= (unsigned long) (*p)[i] << (8*i);
+	*p += bytes;
+	return value;
+}
+
+static void *grow(void *array, int n, size_t size) {
+
+	/* double at powers of two */
+	if (n == 0 || (n & (n-1)) == 0) {
+		array = realloc(array, (n ? 2*n : 1) * size);
+		if (array == NULL)
+			myabort("Error reading trace: Out of memory\n");
+	}
+	return array;
+}
+
+static void load_event(Traceevent *ev, unsigned char **p, unsigned char *end,
+	long usec) {
+
+	ev->usec = usec;
+	ev->ret = (int) get(p, end, 4);
+	ev->err = get(p, end, 2);
+}
+
+/* Parse the trace and restore the profile it was recorded with */
+static void load_trace(Replay *r, unsigned char *p, unsigned char *end,
+	int fd) {
+
+	Profile *profile = fdc_profile(fd);
+	Tracechain *chain;
+	Tracecmd *t;
+	int type, i;
+	long usec;
+
+	while (p < end) {
+		type = *p++;
+		get(&p, end, 4);	/* the gap is not replayed */
+		usec = get(&p, end, 4);
+		switch (type) {
+			case 'C':
+				r->chains = grow(r->chains, r->nchains,
+					sizeof(*r->chains));
+				chain = &r->chains[r->nchains];
+				chain->usec = usec;
+				chain->ret = (int) get(&p, end, 4);
+				chain->err = get(&p, end, 2);
+				chain->n = get(&p, end, 1);
+				chain->first = r->ncmds;
+				for (i=0; i<chain->n; i++) {
+					r->cmds = grow(r->cmds, r->ncmds,
+						sizeof(*r->cmds));
+					t = &r->cmds[r->ncmds++];
+					t->flags = get(&p, end, 4);
+					t->rate = get(&p, end, 1);
+					t->track = get(&p, end, 1);
+					t->asked = (int) get(&p, end, 4);
+					t->left = (int) get(&p, end, 4);
+					t->cmd_count = get(&p, end, 1);
+					if (t->cmd_count > FD_RAW_CMD_SIZE)
+						myabort("Error reading trace: "
+							"Bad command\n");
+					memcpy(t->cmd, p, t->cmd_count);
+					get(&p, end, t->cmd_count);
+					t->reply_count = get(&p, end, 1);
+					if (t->reply_count > FD_RAW_REPLY_SIZE)
+						myabort("Error reading trace: "
+							"Bad reply\n");
+					memcpy(t->reply, p, t->reply_count);
+					get(&p, end, t->reply_count);
+					t->len = get(&p, end, 4);
+					t->data = p;
+					get(&p, end, t->len);
+					t->chain = r->nchains;
+					t->used = FALSE;
+				}
+				r->nchains++;
+				break;
+			case 'R':
+				r->resets = grow(r->resets, r->nresets,
+					sizeof(*r->resets));
+				load_event(&r->resets[r->nresets++], &p, end, usec);
+				break;
+			case 'S':
+				r->stats = grow(r->stats, r->nstats,
+					sizeof(*r->stats));
+				load_event(&r->stats[r->nstats], &p, end, usec);
+				r->stats[r->nstats].flags = get(&p, end, 4);
+				r->stats[r->nstats].track = (short) get(&p, end, 2);
+				r->nstats++;
+				break;
+			case 'P':
+				profile->probed = get(&p, end, 1);
+				profile->rate = get(&p, end, 1);
+				profile->rev_usec = get(&p, end, 4);
+				profile->step_usec = get(&p, end, 4);
+				profile->settle_usec = get(&p, end, 4);
+				profile->latency = get(&p, end, 4);
+				break;
+			default:
+				myabort("Error reading trace: Unknown event\n");
+		}
+	}
+}
+
+/* Was the recorded command t submitted like raw_cmd? */
+static int same_cmd(Tracecmd *t, struct floppy_raw_cmd *raw_cmd) {
+	return (t->flags & KEY_FLAGS) == (raw_cmd->flags & KEY_FLAGS) &&
+		t->rate == raw_cmd->rate && t->track == raw_cmd->track &&
+		t->asked == raw_cmd->length &&
+		t->cmd_count == raw_cmd->cmd_count &&
+		memcmp(t->cmd, raw_cmd->cmd, t->cmd_count) == 0;
+}
+
+/* Hand the recorded results of t to raw_cmd */
+static void replay_cmd(Tracecmd *t, struct floppy_raw_cmd *raw_cmd) {
+
+	raw_cmd->flags = (raw_cmd->flags & 0xFFFF) | (t->flags & ~0xFFFF);
+	raw_cmd->reply_count = t->reply_count;
+	memset(raw_cmd->reply, 0, sizeof(raw_cmd->reply));
+	memcpy(raw_cmd->reply, t->reply, t->reply_count);
+	raw_cmd->length = t->left;
+	if (raw_cmd->data && (raw_cmd->flags & FD_RAW_READ))
+		memcpy(raw_cmd->data, t->data, t->len);
+	t->used = TRUE;
+}
+
+/* The recorded command to answer raw_cmd with out of turn, NULL if there
+ * is none. Commands the recorded chain stopped before are a last resort.
+ */
+static Tracecmd *lookup(Replay *r, struct floppy_raw_cmd *raw_cmd) {
+
+	Tracecmd *t, *unused = NULL, *used = NULL, *skipped = NULL;
+	int i;
+
+	for (i=0; i<r->ncmds; i++) {
+		t = &r->cmds[i];
+		if (!same_cmd(t, raw_cmd))
+			continue;
+		if (t->reply_count == 0 && (t->flags & FD_RAW_INTR)) {
+			skipped = t;
+		} else if (t->used) {
+			used = t;
+		} else if (unused == NULL || (unused->chain < r->chain &&
+			t->chain >= r->chain)) {
+			/* the next one from where the replay has got to */
+			unused = t;
+		}
+	}
+	return unused ? unused : used ? used : skipped;
+}
+
+static int replay_rawcmd(void *priv, struct floppy_raw_cmd *raw_cmd) {
+
+	Replay *r = priv;
+	Tracechain *chain;
+	Tracecmd *t;
+	int i, n, last, failure;
+
+	for (n=1; raw_cmd[n-1].flags & FD_RAW_MORE; n++)
+		;
+
+	/* the chain as recorded next */
+	chain = r->chain < r->nchains ? &r->chains[r->chain] : NULL;
+	for (i=0; chain && i<n; i++) {
+		if (chain->n != n || !same_cmd(&r->cmds[chain->first + i],
+			&raw_cmd[i]))
+			chain = NULL;
+	}
+	if (chain != NULL) {
+		for (i=0; i<n; i++)
+			replay_cmd(&r->cmds[chain->first + i], &raw_cmd[i]);
+		r->chain++;
+		r->exact++;
+		r->clock += chain->usec;
+		errno = chain->err;
+		return chain->ret;
+	}
+
+	/* out of turn: command by command */
+	last = -1;
+	for (i=0; i<n; i++) {
+		t = lookup(r, &raw_cmd[i]);
+		if (t == NULL) {
+			fprintf(stderr, "replay: command %02X on track %d is not "
+				"in the trace\n", raw_cmd[i].cmd[0],
+				raw_cmd[i].track);
+			errno = EIO;
+			return -1;
+		}
+		replay_cmd(t, &raw_cmd[i]);
+		r->looked_up++;
+		if (t->chain > last)
+			last = t->chain;
+		chain = &r->chains[t->chain];
+		r->clock += chain->usec / chain->n;
+		failure = raw_cmd[i].flags & FD_RAW_FAILURE;
+		if ((failure && (raw_cmd[i].flags & FD_RAW_STOP_IF_FAILURE)) ||
+			(!failure && (raw_cmd[i].flags & FD_RAW_STOP_IF_SUCCESS))) {
+			/* rest of the chain is not executed */
+			for (i++; i<n; i++) {
+				raw_cmd[i].reply_count = 0;
+				memset(raw_cmd[i].reply, 0,
+					sizeof(raw_cmd[i].reply));
+			}
+		}
+	}
+	/* carry on in order after the recorded chain answered from */
+	if (last >= r->chain)
+		r->chain = last + 1;
+	return 0;
+}
+
+/* Next recorded event of a list, the last one again when they run out */
+static Traceevent *next_event(Traceevent *events, int n, int *next) {
+
+	if (n == 0)
+		return NULL;
+	return &events[*next < n ? (*next)++ : n-1];
+}
+
+static int replay_reset(void *priv) {
+
+	Replay *r = priv;
+	Traceevent *ev = next_event(r->resets, r->nresets, &r->reset);
+
+	if (ev == NULL)
+		return 0;
+	r->clock += ev->usec;
+	errno = ev->err;
+	return ev->ret;
+}
+
+static long long replay_now(void *priv) {
+
+	Replay *r = priv;
+
+	return r->clock;
+}
+
+static void replay_sleep(void *priv, long usec) {
+
+	Replay *r = priv;
+
+	r->clock += usec;
+}
+
+static int replay_drvstat(void *priv, struct floppy_drive_struct *drvstat) {
+
+	Replay *r = priv;
+	Traceevent *ev = next_event(r->stats, r->nstats, &r->stat);
+
+	memset(drvstat, 0, sizeof(*drvstat));
+	if (ev == NULL) {
+		errno = ENOMEDIUM;
+		return -1;
+	}
+	r->clock += ev->usec;
+	drvstat->flags = ev->flags;
+	drvstat->track = ev->track;
+	errno = ev->err;
+	return ev->ret;
+}
+
+static void replay_close(void *priv) {
+
+	Replay *r = priv;
+
+	fprintf(stderr, "replay: %ld of %d chains in order, %ld commands "
+		"out of turn, %.3f s replayed\n", r->exact, r->nchains,
+		r->looked_up, r->clock / 1000000.0);
+	free(r->cmds);
+	free(r->chains);
+	free(r->resets);
+	free(r->stats);
+	free(r->trace);
+	free(r);
+}
+
+static Fdc_backend replay_backend = {
+	"replay", replay_rawcmd, replay_reset, replay_now, replay_sleep,
+	replay_close, replay_drvstat
+};
+
+int fdctrace_replay(char *trace, int drive) {
+
+	Replay *r;
+	FILE *file;
+	char name[1024];
+	long size;
+	int fd, len = strlen(TRACE_MAGIC);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		myabort("Error opening trace: Out of memory\n");
+	trace_name(name, sizeof(name), trace, drive);
+	file = fopen(name, "rb");
+	if (file == NULL) {
+		perror("Error opening trace");
+		exit(1);
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	r->trace = malloc(size ? size : 1);
+	if (r->trace == NULL)
+		myabort("Error opening trace: Out of memory\n");
+	if (fread(r->trace, 1, size, file) != size) {
+		perror("Error reading trace");
+		exit(1);
+	}
+	fclose(file);
+
+	if (size < len + 2 || memcmp(r->trace, TRACE_MAGIC, len) != 0 ||
+		r->trace[len] != TRACE_VERSION)
+		myabort("Error opening trace: Not a dsktools trace\n");
+	if (r->trace[len+1] != drive) {
+		fprintf(stderr, "Error opening trace: Recorded on drive %d\n",
+			r->trace[len+1]);
+		exit(1);
+	}
+
+	fd = fdc_register(&replay_backend, r, drive);
+	load_trace(r, r->trace + len + 2, r->trace + size, fd);
+	return fd;
+}
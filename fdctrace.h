@@ -0,0 +1,75 @@
+/* $Id$
+ *
+ * fdctrace.h - Recording and replaying FDC command streams for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef FDCTRACE_H
+#define FDCTRACE_H
+
+#include "common.h"
+
+/* FDC traces
+ *
+ * A recorder sits in front of the backend of an FDC handle and logs every
+ * command chain, controller reset and drive state poll with its results,
+ * the data transferred either way and how long it took. The replay backend
+ * plays such a trace back in place of a drive, at CPU speed, on a clock
+ * that advances by the recorded times.
+ *
+ * Chains submitted just as recorded are answered in order. A command that
+ * comes out of turn, because retries or the read order changed, gets the
+ * reply of the next unused recorded command with the same bytes (the last
+ * one once all are used up). Commands not in the trace at all fail with
+ * EIO. Out of turn commands take the time they took when recorded, so a
+ * replay shows what retries cost, but not what a new order gains in
+ * rotation: that is what the simulator is for.
+ *
+ * Trace file, all numbers little endian:
+ *
+ *	"DSKTRACE", version (1 byte), drive (1 byte)
+ *
+ * followed by events, each starting with its type byte, the usec since
+ * the previous event ended (4 bytes) and the usec it took (4 bytes):
+ *
+ *	'C' chain: result (4), errno (2), number of commands (1), then per
+ *	    command: flags after the call (4), rate (1), track (1), length
+ *	    asked for (4), length left (4), cmd_count (1) and the command
+ *	    bytes, reply_count (1) and the reply bytes, data length (4) and
+ *	    the data read or written
+ *	'R' reset: result (4), errno (2)
+ *	'S' drive state: result (4), errno (2), flags (4), track (2)
+ *	'P' drive profile, last: probed, rate (1 each), revolution, step,
+ *	    settle and ioctl time (4 each)
+ */
+#define TRACE_MAGIC	"DSKTRACE"
+#define TRACE_VERSION	1
+
+extern char *flag_record;	/* record FDC handles into this trace */
+extern char *flag_replay;	/* replay this trace instead of a drive */
+
+/* Record all further traffic of the FDC handle fd into file trace. A %d
+ * in the name is replaced by the drive.
+ */
+void fdctrace_record(int fd, char *trace, int drive);
+
+/* Open the trace as a replayed drive, returns an FDC handle as fdc_open()
+ * does. A %d in the name is replaced by the drive.
+ */
+int fdctrace_replay(char *trace, int drive);
+
+#endif /* FDCTRACE_H */
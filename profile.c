@@ -0,0 +1,225 @@
+/* $Id$
+ *
+ * profile.c - Drive profiles for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "profile.h"
+#include "dskimage.h"
+
+int flag_probe = FALSE;		// probe the drive even if it has a profile
+
+#define PROBE_READS 4		/* reads of one sector to time a revolution */
+
+/* data rate codes in the order they are tried, and their bit rates */
+static int probe_rates[] = { 2, 1, 0 };
+static int rate_kbit[] = { 500, 300, 250, 1000 };
+
+static void profile_path(int fd, int drive, char *path, int len) {
+
+	char *home = getenv("HOME");
+	char *backend = fdc_backend_name(fd);
+
+	if (home == NULL)
+		home = ".";
+	if (strcmp(backend, "linux") == 0)
+		snprintf(path, len, "%s/.dsktools-fd%d", home, drive);
+	else
+		snprintf(path, len, "%s/.dsktools-%s-fd%d", home, backend, drive);
+}
+
+int profile_load(int fd, int drive) {
+
+	Profile *profile = fdc_profile(fd);
+	Profile loaded;
+	char path[1024], key[32];
+	long value;
+	FILE *in;
+
+	profile_path(fd, drive, path, sizeof(path));
+	in = fopen(path, "r");
+	if (in == NULL)
+		return FALSE;
+
+	loaded = *profile;
+	while (fscanf(in, "%31s %ld", key, &value) == 2) {
+		if (strcmp(key, "rate") == 0)
+			loaded.rate = value;
+		else if (strcmp(key, "rev_usec") == 0)
+			loaded.rev_usec = value;
+		else if (strcmp(key, "step_usec") == 0)
+			loaded.step_usec = value;
+		else if (strcmp(key, "settle_usec") == 0)
+			loaded.settle_usec = value;
+		else if (strcmp(key, "latency") == 0)
+			loaded.latency = value;
+	}
+	fclose(in);
+
+	if (loaded.rate < 0 || loaded.rate > 3 || loaded.rev_usec <= 0) {
+		fprintf(stderr, "Ignoring broken drive profile %s\n", path);
+		return FALSE;
+	}
+	loaded.probed = TRUE;
+	*profile = loaded;
+	return TRUE;
+}
+
+void profile_save(int fd, int drive) {
+
+	Profile *profile = fdc_profile(fd);
+	char path[1024];
+	FILE *out;
+
+	profile_path(fd, drive, path, sizeof(path));
+	out = fopen(path, "w");
+	if (out == NULL) {
+		perror("Error saving drive profile");
+		return;
+	}
+	fprintf(out, "rate %d\n", profile->rate);
+	fprintf(out, "rev_usec %ld\n", profile->rev_usec);
+	fprintf(out, "step_usec %ld\n", profile->step_usec);
+	fprintf(out, "settle_usec %ld\n", profile->settle_usec);
+	fprintf(out, "latency %ld\n", profile->latency);
+	fclose(out);
+}
+
+/* READ ID at rate on the current track, side 0. Returns FALSE if no ID
+ * was found, chrn is set to the ID otherwise.
+ */
+static int probe_id(int fd, int drive, int rate, unsigned char *chrn) {
+
+	struct floppy_raw_cmd raw_cmd;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.rate = rate;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0x4A;	/* READ ID, MFM */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+	if (fdc_rawcmd(fd, &raw_cmd) < 0 || raw_cmd.reply_count < 7 ||
+		(raw_cmd.reply[0] & 0xC0))
+		return FALSE;
+	memcpy(chrn, &raw_cmd.reply[3], 4);
+	return TRUE;
+}
+
+/* Read the sector chrn PROBE_READS times in a row. Every read but the
+ * first waits for the sector to come round again, so they end one
+ * revolution apart. Returns the revolution time or 0.
+ */
+static long probe_rev(int fd, int drive, int rate, unsigned char *chrn) {
+
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char data[128<<6];
+	long long first = 0, last = 0;
+	int i, ok = 0;
+
+	for (i=0; i<PROBE_READS; i++) {
+		init_raw_cmd(&raw_cmd);
+		raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
+		raw_cmd.rate = rate;
+		raw_cmd.length = sector_size(chrn[3]);
+		raw_cmd.data = data;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = 0x46;	/* READ DATA, MFM */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FDC_UNIT(drive);
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[0];
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[1];
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[2];
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[3];
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[2];	/* EOT */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = GAP;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = chrn[3] ? 0xFF : 0x80;
+		if (fdc_rawcmd(fd, &raw_cmd) < 0 || raw_cmd.reply_count == 0 ||
+			(raw_cmd.reply[0] & 0x40))
+			return 0;
+		last = fdc_now(fd);
+		if (i == 0)
+			first = last;
+		ok++;
+	}
+	return (last - first) / (ok - 1);
+}
+
+/* Time a seek from track 0, returns usec */
+static long probe_seek(int fd, int drive, int track) {
+
+	long long start;
+
+	seek(fd, drive, 0);
+	start = fdc_now(fd);
+	seek(fd, drive, track);
+	start = fdc_now(fd) - start;
+	seek(fd, drive, 0);
+	return start;
+}
+
+void probe_drive(int fd, int drive) {
+
+	Profile *profile = fdc_profile(fd);
+	unsigned char chrn[4];
+	long rev, one, many;
+	int i;
+
+	profile->latency = ioctl_latency(fd, drive);
+
+	seek(fd, drive, 0);
+	for (i=0; i<sizeof(probe_rates)/sizeof(probe_rates[0]); i++)
+		if (probe_id(fd, drive, probe_rates[i], chrn))
+			break;
+	if (i == sizeof(probe_rates)/sizeof(probe_rates[0]))
+		myabort("Error probing drive: No readable disk in it\n");
+	profile->rate = probe_rates[i];
+
+	/* anything between 150 and 400 rpm is a plausible drive */
+	rev = probe_rev(fd, drive, profile->rate, chrn);
+	if (rev >= 150000 && rev <= 400000)
+		profile->rev_usec = rev;
+	else
+		fprintf(stderr, "Could not time a revolution, assuming %.1f rpm\n",
+			60000000.0 / profile->rev_usec);
+
+	/* a seek takes a fixed time plus the steps */
+	one = probe_seek(fd, drive, 1);
+	many = probe_seek(fd, drive, TRACKS-1);
+	profile->step_usec = (many - one) / (TRACKS-2);
+	profile->settle_usec = one - profile->step_usec - profile->latency;
+	if (profile->step_usec < 0)
+		profile->step_usec = 0;
+	if (profile->settle_usec < 0)
+		profile->settle_usec = 0;
+
+	profile->probed = TRUE;
+	fprintf(stderr, "Drive %d: %d kbit/s, %.1f rpm, step %.1f ms, "
+		"settle %.1f ms, ioctl %.1f ms\n", drive, rate_kbit[profile->rate],
+		60000000.0 / profile->rev_usec, profile->step_usec / 1000.0,
+		profile->settle_usec / 1000.0, profile->latency / 1000.0);
+}
+
+long profile_init(int fd, int drive) {
+
+	Profile *profile = fdc_profile(fd);
+
+	if (!flag_probe)
+		profile_load(fd, drive);
+	init(fd, drive);
+	if (flag_probe) {
+		probe_drive(fd, drive);
+		profile_save(fd, drive);
+	}
+	return profile->probed ? profile->latency : ioctl_latency(fd, drive);
+}
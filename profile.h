@@ -0,0 +1,50 @@
+/* $Id$
+ *
+ * profile.h - Drive profiles for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+
+/* Drive profiles
+ *
+ * probe_drive() measures the data rate a disk can be read at, the
+ * revolution time, the step and settle time and the ioctl turnaround of a
+ * drive. The profile is saved in ~/.dsktools-fd<drive> (~/.dsktools-sim-fd
+ * <drive> for simulated drives) and loaded by later runs, so they use the
+ * real timings without measuring them again.
+ */
+extern int flag_probe;		/* probe the drive even if it has a profile */
+
+/* Load the saved profile of drive into fd, returns FALSE if there is none */
+int profile_load(int fd, int drive);
+
+/* Save the profile of fd */
+void profile_save(int fd, int drive);
+
+/* Measure the profile of the drive, a formatted disk has to be in it */
+void probe_drive(int fd, int drive);
+
+/* Load the profile of the drive, initialise it and probe it if flag_probe
+ * is set. Returns the ioctl turnaround in usec.
+ */
+long profile_init(int fd, int drive);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,332 @@
+/* $Id$
+ *
+ * recover.c - Multi-pass recovery of failed sectors for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "recover.h"
+#include "dskimage.h"
+#include "fdcread.h"
+#include "stats.h"
+
+/* the copies of a failed sector */
+typedef struct copies_t {
+	int j;			/* sector of the track */
+	int size;
+	int count;		/* copies kept */
+	int done;		/* read without error */
+	unsigned char *copy;	/* RECOVER_COPIES copies of size bytes */
+} Copies;
+
+/* a track with failed sectors */
+typedef struct rtrack_t {
+	int n;			/* checkpointed track */
+	Trackinfo trackinfo;
+	unsigned char data[MAX_TRACKLEN];
+	int offset[29];
+	int len;
+	int nsect;
+	int pending;		/* sectors not read without error yet */
+	Copies sect[29];
+} Rtrack;
+
+static int data_error(int st1, int st2) {
+	return (st1 & ST1_CRC) && (st2 & ST2_CRC);
+}
+
+static void keep(Copies *c, unsigned char *data) {
+
+	if (c->count < RECOVER_COPIES)
+		memcpy(c->copy + c->count++ * c->size, data, c->size);
+}
+
+/* Data bytes stored of sector j of a loaded track */
+static int stored(Rtrack *t, int j) {
+	return (j+1 < t->trackinfo.spt ? t->offset[j+1] : t->len) - t->offset[j];
+}
+
+/* Load checkpointed track n, the copies in the image are the first ones */
+static Rtrack *load_track(Checkpoint *ckp, int n, Recover_stats *stats) {
+
+	Rtrack *t;
+	Sectorinfo *sectorinfo;
+	Copies *c;
+	int j, k;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		myabort("Error recovering: Out of memory\n");
+	t->n = n;
+	checkpoint_load(ckp, n, &t->trackinfo, t->data);
+	t->len = dskimage_stored(&t->trackinfo, ckp->writer->extended,
+		t->offset);
+
+	for (j=0; j<t->trackinfo.spt; j++) {
+		sectorinfo = &t->trackinfo.sectorinfo[j];
+		if (!(ckp->failed[n] & (1UL << j)) ||
+			stored(t, j) < sector_size(sectorinfo->bps))
+			continue;
+		c = &t->sect[t->nsect++];
+		c->j = j;
+		c->size = sector_size(sectorinfo->bps);
+		c->copy = malloc(RECOVER_COPIES * c->size);
+		if (c->copy == NULL)
+			myabort("Error recovering: Out of memory\n");
+		if (data_error(sectorinfo->err1, sectorinfo->err2)) {
+			for (k=0; (k+1) * c->size <= stored(t, j); k++)
+				keep(c, t->data + t->offset[j] + k * c->size);
+		}
+		stats->failed++;
+	}
+	t->pending = t->nsect;
+	return t;
+}
+
+/* Read the pending sectors of a track with one chain */
+static void read_track_copies(int fd, Rtrack *t, int drive, int startside,
+	int nsides, int pass, Recover_stats *stats) {
+
+	struct floppy_raw_cmd cmds[29];
+	unsigned char buf[MAX_TRACKLEN];
+	Sectorinfo *sectorinfo;
+	Copies *c;
+	int sect[29];
+	int i, m, pos, track, side;
+
+	track = t->n / nsides;
+	side = (startside + t->n % nsides) % MAX_SIDES;
+	if (pass > 0)
+		seek(fd, drive, track > 0 ? track - 1 : track + 1);
+	seek(fd, drive, track);
+
+	for (i=0, m=0, pos=0; i<t->nsect; i++) {
+		c = &t->sect[i];
+		if (c->done)
+			continue;
+		init_read_cmd(fd, &cmds[m], &t->trackinfo,
+			&t->trackinfo.sectorinfo[c->j], buf + pos, track, side,
+			drive);
+		cmds[m].flags |= FD_RAW_MORE;
+		sect[m++] = i;
+		pos += c->size;
+	}
+	cmds[m-1].flags &= ~FD_RAW_MORE;
+
+	if (fdc_rawcmd(fd, cmds) < 0) {
+		perror("Error reading");
+		exit(1);
+	}
+
+	for (i=0, pos=0; i<m; i++) {
+		c = &t->sect[sect[i]];
+		sectorinfo = &t->trackinfo.sectorinfo[c->j];
+		stats_retry(fd, track);
+		if (read_ok(&cmds[i])) {
+			memcpy(t->data + t->offset[c->j], buf + pos, c->size);
+			sectorinfo->err1 = 0;
+			sectorinfo->err2 = cmds[i].reply[2] & ST2_CM;
+			c->done = TRUE;
+			t->pending--;
+			stats->recovered++;
+		} else if (cmds[i].reply_count &&
+			data_error(cmds[i].reply[1], cmds[i].reply[2])) {
+			keep(c, buf + pos);
+			sectorinfo->err1 = cmds[i].reply[1];
+			sectorinfo->err2 = cmds[i].reply[2];
+		}
+		pos += c->size;
+	}
+}
+
+/* Majority vote on every byte of the copies, returns TRUE if they differ */
+static int merge(Copies *c, unsigned char *merged) {
+
+	int b, k, l, votes, best, weak = FALSE;
+	unsigned char byte;
+
+	for (b=0; b<c->size; b++) {
+		best = 0;
+		for (k=0; k<c->count; k++) {
+			byte = c->copy[k * c->size + b];
+			for (votes=0, l=0; l<c->count; l++)
+				if (c->copy[l * c->size + b] == byte)
+					votes++;
+			if (votes > best) {
+				best = votes;
+				merged[b] = byte;
+			}
+		}
+		if (best < c->count)
+			weak = TRUE;
+	}
+	return weak;
+}
+
+/* Store the merged copy and then the other different ones of a weak
+ * sector, returns the number of copies stored.
+ */
+static int store_copies(Copies *c, unsigned char *merged, unsigned char *out,
+	int room) {
+
+	int k, l, n = 1;
+
+	memcpy(out, merged, c->size);
+	for (k=0; k<c->count && n<RECOVER_STORED &&
+		(n+1) * c->size <= room; k++) {
+		for (l=0; l<n; l++)
+			if (!memcmp(out + l * c->size, c->copy + k * c->size,
+				c->size))
+				break;
+		if (l == n)
+			memcpy(out + n++ * c->size, c->copy + k * c->size,
+				c->size);
+	}
+	return n;
+}
+
+/* Merge the copies of a track into its data, as it goes into the image */
+static void merge_track(int fd, Checkpoint *ckp, Rtrack *t, int nsides,
+	Recover_stats *stats) {
+
+	Report report;
+	FILE *msg = report_begin(&report);
+	unsigned char out[MAX_TRACKLEN];
+	Sectorinfo *sectorinfo;
+	Copies *c;
+	int copies[29];
+	int i, j, len, size, weak;
+
+	for (j=0; j<t->trackinfo.spt; j++)
+		copies[j] = 0;
+	for (i=0; i<t->nsect; i++) {
+		c = &t->sect[i];
+		sectorinfo = &t->trackinfo.sectorinfo[c->j];
+		fprintf(msg, "Track %d side %d sector %02X: ",
+			t->n / nsides, t->n % nsides, sectorinfo->sector);
+		if (c->done) {
+			fprintf(msg, "read\n");
+			copies[c->j] = 1;
+		} else if (c->count == 0) {
+			fprintf(msg, "no data\n");
+		} else {
+			weak = merge(c, t->data + t->offset[c->j]);
+			copies[c->j] = weak ? -1 : 1;
+			stats->merged++;
+			if (weak)
+				stats->weak++;
+			fprintf(msg, "merged from %d copies%s\n", c->count,
+				weak ? ", weak" : "");
+		}
+	}
+	report_end(&report, fd);
+
+	if (!ckp->writer->extended)
+		return;
+
+	/* EDSK: the sectors again back to back, weak ones in copies */
+	for (j=0, len=0; j<t->trackinfo.spt; j++) {
+		sectorinfo = &t->trackinfo.sectorinfo[j];
+		size = stored(t, j);
+		if (copies[j] != 0)
+			size = sector_size(sectorinfo->bps);
+		if (len + size > MAX_TRACKLEN)
+			myabort("Error recovering: Track too long\n");
+		memcpy(out + len, t->data + t->offset[j], size);
+		if (copies[j] < 0) {
+			for (i=0; t->sect[i].j != j; i++)
+				;
+			size *= store_copies(&t->sect[i], t->data + t->offset[j],
+				out + len, MAX_TRACKLEN - len);
+		}
+		sectorinfo->unused1 = size & 0xFF;
+		sectorinfo->unused2 = size >> 8;
+		len += size;
+	}
+	memcpy(t->data, out, len);
+	t->len = len;
+}
+
+void recover_disk(int fd, Checkpoint *ckp, int drive, int startside,
+	int nsides, Recover_stats *stats) {
+
+	Rtrack **tracks, *t;
+	Trackinfo *infos[0xCC];
+	unsigned char *datas[0xCC];
+	int nums[0xCC], lens[0xCC];
+	int n, i, k, m, ntracks = 0, pending = 0, pass;
+	long long start = fdc_now(fd);
+
+	memset(stats, 0, sizeof(*stats));
+	tracks = malloc((ckp->ntracks + 1) * sizeof(*tracks));
+	if (tracks == NULL)
+		myabort("Error recovering: Out of memory\n");
+	for (n=0; n<ckp->ntracks; n++) {
+		if (ckp->failed[n] == 0)
+			continue;
+		t = load_track(ckp, n, stats);
+		tracks[ntracks++] = t;
+		pending += t->pending;
+	}
+
+	/* back and forth across the disk */
+	for (pass=0; pass<flag_recover && pending > 0; pass++) {
+		stats->passes++;
+		for (k=0; k<ntracks; k++) {
+			t = tracks[pass % 2 ? ntracks-1-k : k];
+			if (t->pending == 0)
+				continue;
+			pending -= t->pending;
+			read_track_copies(fd, t, drive, startside, nsides, pass,
+				stats);
+			pending += t->pending;
+		}
+	}
+
+	/* all tracks go into the image at once, so that the tracks after
+	   one that grows are moved only once */
+	for (k=0, m=0; k<ntracks; k++) {
+		t = tracks[k];
+		if (t->nsect == 0)
+			continue;
+		merge_track(fd, ckp, t, nsides, stats);
+		nums[m] = t->n;
+		infos[m] = &t->trackinfo;
+		datas[m] = t->data;
+		lens[m++] = t->len;
+	}
+	if (m > 0)
+		checkpoint_replace(ckp, m, nums, infos, datas, lens);
+
+	for (k=0; k<ntracks; k++) {
+		t = tracks[k];
+		for (i=0; i<t->nsect; i++)
+			free(t->sect[i].copy);
+		free(t);
+	}
+	free(tracks);
+	stats->usec = fdc_now(fd) - start;
+}
+
+void recover_summary(FILE *out, Recover_stats *stats) {
+
+	if (stats->failed == 0)
+		return;
+	fprintf(out, "Recovery: %d sectors failed, %d passes, %d read, "
+		"%d merged (%d weak), %.2f s\n", stats->failed, stats->passes,
+		stats->recovered, stats->merged, stats->weak,
+		stats->usec / 1000000.0);
+}
@@ -0,0 +1,60 @@
+/* $Id$
+ *
+ * recover.h - Multi-pass recovery of failed sectors for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include "common.h"
+#include "checkpoint.h"
+
+/* Recovery stage
+ *
+ * With flag_recover set the disk is first read without any retries, a
+ * sector that fails is left as it came. Then up to flag_recover passes go
+ * over the tracks with failed sectors, back and forth across the disk, and
+ * read all failed sectors of a track with one chain. Every pass after the
+ * first steps off each track and back before reading it.
+ *
+ * Every copy of a sector that came with data is kept, the one in the image
+ * being the first. A copy read without error is taken as it is. Otherwise
+ * the sector is merged from its copies by a majority vote on every byte.
+ * If the copies differ the sector is weak: an EDSK image stores the merged
+ * copy followed by the other different ones, as multiple copies of the
+ * sector. A DSK image gets the merged copy only.
+ */
+#define RECOVER_COPIES 8	/* copies kept of a sector */
+#define RECOVER_STORED 4	/* copies stored of a weak sector */
+
+typedef struct recover_stats_t {
+	int failed;		/* sectors failed before the recovery */
+	int recovered;		/* read without error later */
+	int merged;		/* merged from copies with errors */
+	int weak;		/* merged from copies that differ */
+	int passes;
+	long long usec;
+} Recover_stats;
+
+/* Recover the failed sectors of the checkpointed tracks of ckp */
+void recover_disk(int fd, Checkpoint *ckp, int drive, int startside,
+	int nsides, Recover_stats *stats);
+
+void recover_summary(FILE *out, Recover_stats *stats);
+
+#endif /* RECOVER_H */
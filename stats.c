@@ -0,0 +1,316 @@
+/* $Id$
+ *
+ * stats.c - Run statistics of the FDC handles for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+
+char *flag_json = NULL;		// write the statistics to this JSON file
+char *flag_chrome = NULL;	// write a Chrome trace to this file
+
+static char *kind_names[STAT_KINDS] = {
+	"READ_ID", "READ_DATA", "READ_TRACK", "WRITE", "FORMAT", "SEEK",
+	"RECALIBRATE", "OTHER"
+};
+
+typedef struct kind_stats_t {
+	long ioctls;
+	long cmds;
+	long long usec;
+	long min, max;
+	long hist[STAT_BUCKETS];
+} Kind_stats;
+
+/* per FDC handle, cleared when it is opened */
+static struct fdc_stats_t {
+	int drive;
+	Kind_stats kind[STAT_KINDS];
+	long tracks;
+	long long track_usec;
+	long long lost_usec;
+	long retries[MAX_TRACKS];
+	long long offset;	/* added to the clock in the Chrome trace */
+	int started;
+} stats[MAX_FDC];
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *json, *chrome;
+static int json_handles, chrome_events;
+static long long drive_end[MAX_FDC];	/* last Chrome trace time per drive */
+
+static void stats_exit(void) {
+
+	if (json != NULL) {
+		fprintf(json, "\n]\n");
+		fclose(json);
+	}
+	if (chrome != NULL) {
+		fprintf(chrome, "\n]}\n");
+		fclose(chrome);
+	}
+}
+
+/* Open the output files on first use */
+static void open_files(void) {
+
+	static int opened = FALSE;
+
+	if (opened)
+		return;
+	opened = TRUE;
+	if (flag_json != NULL) {
+		json = fopen(flag_json, "w");
+		if (json == NULL) {
+			perror("Error opening JSON file");
+			exit(1);
+		}
+		fprintf(json, "[");
+	}
+	if (flag_chrome != NULL) {
+		chrome = fopen(flag_chrome, "w");
+		if (chrome == NULL) {
+			perror("Error opening trace file");
+			exit(1);
+		}
+		fprintf(chrome, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	}
+	atexit(stats_exit);
+}
+
+/* Kind of one command */
+static int cmd_kind(struct floppy_raw_cmd *raw_cmd) {
+
+	if (raw_cmd->cmd_count == 0)
+		return STAT_OTHER;
+	switch (raw_cmd->cmd[0] & 0x1F) {
+		case 0x0A:	return STAT_READ_ID;
+		case 0x06:
+		case 0x0C:	return STAT_READ_DATA;
+		case 0x02:	return STAT_READ_TRACK;
+		case 0x05:
+		case 0x09:	return STAT_WRITE;
+		case 0x0D:	return STAT_FORMAT;
+		case 0x0F:	return STAT_SEEK;
+		case 0x07:	return STAT_RECAL;
+	}
+	return STAT_OTHER;
+}
+
+/* Chrome trace event, the caller holds stats_lock */
+static void chrome_event(int fd, char *name, char *cat, long long ts,
+	long long dur, char *args) {
+
+	struct fdc_stats_t *s = &stats[fd];
+
+	/* simulated clocks start at 0, keep jobs on one drive apart */
+	if (!s->started) {
+		s->started = TRUE;
+		if (ts < drive_end[s->drive])
+			s->offset = drive_end[s->drive] - ts;
+	}
+	ts += s->offset;
+	if (ts + dur > drive_end[s->drive])
+		drive_end[s->drive] = ts + dur;
+
+	fprintf(chrome, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", ",
+		chrome_events++ ? "," : "", name, cat);
+	if (dur < 0)
+		fprintf(chrome, "\"ph\": \"i\", \"s\": \"t\", ");
+	else
+		fprintf(chrome, "\"ph\": \"X\", \"dur\": %lld, ", dur);
+	fprintf(chrome, "\"ts\": %lld, \"pid\": 0, \"tid\": %d, "
+		"\"args\": {%s}}", ts, s->drive, args);
+}
+
+void stats_open(int fd, int drive) {
+
+	pthread_mutex_lock(&stats_lock);
+	memset(&stats[fd], 0, sizeof(stats[fd]));
+	stats[fd].drive = drive;
+	open_files();
+	if (chrome != NULL)
+		fprintf(chrome, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+			"\"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"fd%d\"}}",
+			chrome_events++ ? "," : "", drive, drive);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_ioctl(int fd, struct floppy_raw_cmd *raw_cmd, long long start,
+	long long end) {
+
+	int i, n, kind, count[STAT_KINDS];
+	long usec = end - start;
+	Kind_stats *k;
+	char args[64];
+
+	/* the kind most commands of the chain are of */
+	memset(count, 0, sizeof(count));
+	kind = cmd_kind(raw_cmd);
+	for (n=0; ; n++) {
+		i = cmd_kind(&raw_cmd[n]);
+		if (++count[i] > count[kind])
+			kind = i;
+		if (!(raw_cmd[n].flags & FD_RAW_MORE))
+			break;
+	}
+	n++;
+
+	pthread_mutex_lock(&stats_lock);
+	k = &stats[fd].kind[kind];
+	if (k->ioctls == 0 || usec < k->min)
+		k->min = usec;
+	if (usec > k->max)
+		k->max = usec;
+	k->ioctls++;
+	k->cmds += n;
+	k->usec += usec;
+	for (i=0; i<STAT_BUCKETS-1 && usec >= (1000L << i); i++)
+		;
+	k->hist[i]++;
+	if (chrome != NULL) {
+		snprintf(args, sizeof(args), "\"track\": %d, \"commands\": %d",
+			raw_cmd->track, n);
+		chrome_event(fd, kind_names[kind], "ioctl", start, usec, args);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_track(int fd, int track, int side, long usec, long ideal) {
+
+	char name[32], args[64];
+
+	pthread_mutex_lock(&stats_lock);
+	stats[fd].tracks++;
+	stats[fd].track_usec += usec;
+	if (ideal > 0 && usec > ideal)
+		stats[fd].lost_usec += usec - ideal;
+	if (chrome != NULL) {
+		snprintf(name, sizeof(name), "track %d/%d", track, side);
+		snprintf(args, sizeof(args), "\"ideal\": %ld", ideal);
+		chrome_event(fd, name, "track", fdc_now(fd) - usec, usec, args);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_retry(int fd, int track) {
+
+	char args[32];
+
+	pthread_mutex_lock(&stats_lock);
+	if (track >= 0 && track < MAX_TRACKS)
+		stats[fd].retries[track]++;
+	if (chrome != NULL) {
+		snprintf(args, sizeof(args), "\"track\": %d", track);
+		chrome_event(fd, "retry", "retry", fdc_now(fd), -1, args);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_summary(FILE *out, int fd) {
+
+	struct fdc_stats_t *s = &stats[fd];
+	Kind_stats *k;
+	long rev = fdc_profile(fd)->rev_usec;
+	int i, j, any;
+	char label[16];
+
+	fprintf(out, "%-12s %6s %6s %8s %8s %8s %8s\n", "FDC ioctls", "count",
+		"cmds", "total s", "min ms", "avg ms", "max ms");
+	for (i=0; i<STAT_KINDS; i++) {
+		k = &s->kind[i];
+		if (k->ioctls == 0)
+			continue;
+		fprintf(out, "%-12s %6ld %6ld %8.2f %8.1f %8.1f %8.1f\n",
+			kind_names[i], k->ioctls, k->cmds, k->usec / 1000000.0,
+			k->min / 1000.0, k->usec / 1000.0 / k->ioctls,
+			k->max / 1000.0);
+	}
+	fprintf(out, "%-12s", "Latency ms");
+	for (j=0; j<STAT_BUCKETS-1; j++) {
+		snprintf(label, sizeof(label), "<%ld", 1L << j);
+		fprintf(out, " %5s", label);
+	}
+	fprintf(out, " %5s\n", "more");
+	for (i=0; i<STAT_KINDS; i++) {
+		k = &s->kind[i];
+		if (k->ioctls == 0)
+			continue;
+		fprintf(out, "%-12s", kind_names[i]);
+		for (j=0; j<STAT_BUCKETS; j++)
+			fprintf(out, " %5ld", k->hist[j]);
+		fprintf(out, "\n");
+	}
+
+	if (s->tracks > 0)
+		fprintf(out, "Tracks: %ld, %.1f revolutions, %.1f lost\n",
+			s->tracks, (double) s->track_usec / rev,
+			(double) s->lost_usec / rev);
+	for (any=FALSE, i=0; i<MAX_TRACKS; i++) {
+		if (s->retries[i] == 0)
+			continue;
+		fprintf(out, "%s %d:%ld", any ? "" : "Retries per track:", i,
+			s->retries[i]);
+		any = TRUE;
+	}
+	if (any)
+		fprintf(out, "\n");
+}
+
+void stats_close(int fd) {
+
+	struct fdc_stats_t *s = &stats[fd];
+	Kind_stats *k;
+	long rev = fdc_profile(fd)->rev_usec;
+	int i, j, any;
+
+	pthread_mutex_lock(&stats_lock);
+	if (json == NULL) {
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+	fprintf(json, "%s\n{\"drive\": %d, \"backend\": \"%s\", "
+		"\"rev_usec\": %ld,\n \"ioctls\": {", json_handles++ ? "," : "",
+		s->drive, fdc_backend_name(fd), rev);
+	for (any=FALSE, i=0; i<STAT_KINDS; i++) {
+		k = &s->kind[i];
+		if (k->ioctls == 0)
+			continue;
+		fprintf(json, "%s\n  \"%s\": {\"count\": %ld, \"commands\": %ld, "
+			"\"usec\": %lld, \"min_usec\": %ld, \"max_usec\": %ld, "
+			"\"histogram_ms\": [", any ? "," : "", kind_names[i],
+			k->ioctls, k->cmds, k->usec, k->min, k->max);
+		for (j=0; j<STAT_BUCKETS; j++)
+			fprintf(json, "%s%ld", j ? ", " : "", k->hist[j]);
+		fprintf(json, "]}");
+		any = TRUE;
+	}
+	fprintf(json, "},\n \"tracks\": %ld, \"track_usec\": %lld, "
+		"\"lost_usec\": %lld,\n \"retries\": {", s->tracks,
+		s->track_usec, s->lost_usec);
+	for (any=FALSE, i=0; i<MAX_TRACKS; i++) {
+		if (s->retries[i] == 0)
+			continue;
+		fprintf(json, "%s\"%d\": %ld", any ? ", " : "", i,
+			s->retries[i]);
+		any = TRUE;
+	}
+	fprintf(json, "}}");
+	pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,76 @@
+/* $Id$
+ *
+ * stats.h - Run statistics of the FDC handles for dsktools.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+
+/* Run statistics
+ *
+ * fdc_rawcmd() times every ioctl on the clock of its backend and files it
+ * under the kind of command the chain is made of, in a latency histogram
+ * with power of two buckets from 1 ms up. The tools add the time every
+ * track took and retry_next() the retries per track. A track that takes
+ * longer than one revolution, or than its schedule if that is longer, has
+ * lost the difference.
+ *
+ * At the end of a run stats_summary() prints all of that. With flag_json
+ * the statistics of every FDC handle go to a JSON file as well, with
+ * flag_chrome every ioctl, track and retry goes to a trace file for
+ * chrome://tracing or Perfetto, one row per drive.
+ */
+#define STAT_READ_ID	0
+#define STAT_READ_DATA	1
+#define STAT_READ_TRACK	2
+#define STAT_WRITE	3
+#define STAT_FORMAT	4
+#define STAT_SEEK	5
+#define STAT_RECAL	6
+#define STAT_OTHER	7
+#define STAT_KINDS	8
+
+#define STAT_BUCKETS	12	/* < 1 ms, < 2 ms, ... < 1024 ms, longer */
+
+extern char *flag_json;		/* write the statistics to this JSON file */
+extern char *flag_chrome;	/* write a Chrome trace to this file */
+
+/* Clear the statistics of a newly opened FDC handle */
+void stats_open(int fd, int drive);
+
+/* Account an ioctl with the chain raw_cmd from start to end */
+void stats_ioctl(int fd, struct floppy_raw_cmd *raw_cmd, long long start,
+	long long end);
+
+/* Account a track read or written in usec that should have taken ideal
+ * usec, 0 if that is not known.
+ */
+void stats_track(int fd, int track, int side, long usec, long ideal);
+
+/* Account a retry on track */
+void stats_retry(int fd, int track);
+
+/* Print the ioctl latencies, the lost revolutions and retries per track */
+void stats_summary(FILE *out, int fd);
+
+/* Called by fdc_close(), adds the handle to the JSON file */
+void stats_close(int fd);
+
+#endif /* STATS_H */